@@ -0,0 +1,626 @@
+/* $Id$ */
+/*
+ * %PSC_START_COPYRIGHT%
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2011-2015, Pittsburgh Supercomputing Center (PSC).
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Pittsburgh Supercomputing Center	phone: 412.268.4960  fax: 412.268.5832
+ * 300 S. Craig Street			e-mail: remarks@psc.edu
+ * Pittsburgh, PA 15213			web: http://www.psc.edu/
+ * -----------------------------------------------------------------------------
+ * %PSC_END_COPYRIGHT%
+ */
+
+/*
+ * Digest trees for --checksum.  A file is hashed in chunks by a pool
+ * of threads so that a large file keeps all cores busy on either side,
+ * and the digests of the chunks are combined into a tree so that equal
+ * parts of a file are recognized with few digests exchanged.
+ *
+ * With --checksum-cache, the receiver hashes the chunks of each file
+ * sent to it in chunks as they are written and keeps the digests in an
+ * extended attribute, or a file under CKCACHE_DIR when too many for
+ * one, so the next comparison against it reads no data as long as the
+ * file was not touched since.  That directory is only created when
+ * needed and left out of walks.  Files built by --delta are not hashed
+ * as their pieces do not line up with chunks, and neither are those
+ * sent inline with their names.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pfl/alloc.h"
+#include "pfl/atomic.h"
+#include "pfl/listcache.h"
+#include "pfl/lock.h"
+#include "pfl/thread.h"
+#include "pfl/waitq.h"
+
+#include "options.h"
+#include "psync.h"
+#include "rpc.h"
+
+#define NCKSUMTHRS_MAX		64
+
+struct cksum_job;
+
+/* hands a job to a helper thread */
+struct cksum_task {
+	struct psc_listentry	 t_lentry;
+	struct cksum_job	*t_job;
+};
+
+struct cksum_job {
+	int			 j_fd;
+	const char		*j_base;	/* mapping, or NULL to read */
+	off_t			 j_size;
+	size_t			 j_leafsz;
+	unsigned char		*j_leaves;
+	uint64_t		 j_nleaves;
+	psc_atomic64_t		 j_next;	/* next leaf to claim */
+	psc_spinlock_t		 j_lock;
+	struct psc_waitq	 j_wq;
+	int			 j_nhelpers;	/* tasks not done yet */
+	int			 j_error;
+	struct cksum_task	 j_tasks[NCKSUMTHRS_MAX];
+};
+
+struct psc_listcache	 cksumq;
+int			 cksum_nthrs;
+
+psc_atomic64_t		 cksum_nunchanged = PSC_ATOMIC64_INIT(0);
+
+/*
+ * Hash leaves of a job until none are left to claim.
+ */
+void
+cksum_run(struct cksum_job *j, void *buf)
+{
+	const char *p;
+	uint64_t i;
+	ssize_t rc;
+	off_t off;
+	size_t len;
+
+	for (;;) {
+		i = psc_atomic64_inc_getnew(&j->j_next) - 1;
+		if (i >= j->j_nleaves)
+			break;
+		off = i * j->j_leafsz;
+		len = MIN(j->j_leafsz, (size_t)(j->j_size - off));
+		if (j->j_base)
+			p = j->j_base + off;
+		else {
+			rc = pread(j->j_fd, buf, len, off);
+			if (rc != (ssize_t)len) {
+				spinlock(&j->j_lock);
+				j->j_error = rc == -1 ? errno : EIO;
+				freelock(&j->j_lock);
+				continue;
+			}
+			p = buf;
+		}
+		digest_buf(p, len, j->j_leaves + i * ALGLEN);
+	}
+}
+
+void
+cksumthr_main(struct psc_thread *thr)
+{
+	struct cksum_task *t;
+	struct cksum_job *j;
+	size_t bufsz = 0;
+	void *buf = NULL;
+
+	while (pscthr_run(thr)) {
+		t = lc_getwait(&cksumq);
+		if (t == NULL)
+			break;
+		j = t->t_job;
+		if (j->j_base == NULL && bufsz < j->j_leafsz) {
+			buf = psc_realloc(buf, j->j_leafsz, 0);
+			bufsz = j->j_leafsz;
+		}
+		cksum_run(j, buf);
+
+		/* the job may be gone as soon as this is seen */
+		spinlock(&j->j_lock);
+		j->j_nhelpers--;
+		psc_waitq_wakeall(&j->j_wq);
+		freelock(&j->j_lock);
+	}
+	PSCFREE(buf);
+}
+
+void
+cksum_init(void)
+{
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	static psc_atomic32_t init = PSC_ATOMIC32_INIT(0);
+
+	int i;
+
+	if (psc_atomic32_read(&init))
+		return;
+
+	pthread_mutex_lock(&mutex);
+	if (psc_atomic32_read(&init) == 0) {
+		lc_reginit(&cksumq, struct cksum_task, t_lentry, "cksumq");
+
+		/* the thread asking takes a share as well */
+		cksum_nthrs = MIN(getnprocessors(), NCKSUMTHRS_MAX) - 1;
+		for (i = 0; i < cksum_nthrs; i++)
+			pscthr_setready(pscthr_init(THRT_CKSUM,
+			    cksumthr_main, NULL, 0, "cksumthr%d", i));
+		psc_atomic32_set(&init, 1);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * Hash a file in chunks of @leafsz bytes, either from its mapping at
+ * @base or by reading @fd.  Returns the digests or NULL on error, with
+ * errno set.
+ */
+unsigned char *
+cksum_leaves(int fd, const char *base, off_t size, size_t leafsz)
+{
+	struct cksum_job j;
+	void *buf = NULL;
+	int i, n;
+
+	cksum_init();
+
+	memset(&j, 0, sizeof(j));
+	j.j_fd = fd;
+	j.j_base = base;
+	j.j_size = size;
+	j.j_leafsz = leafsz;
+	j.j_nleaves = howmany(size, leafsz);
+	j.j_leaves = PSCALLOC(MAX(j.j_nleaves, 1) * ALGLEN);
+	INIT_SPINLOCK(&j.j_lock);
+	psc_waitq_init(&j.j_wq, "cksum");
+
+	n = MIN((uint64_t)cksum_nthrs, j.j_nleaves - 1);
+	j.j_nhelpers = n;
+	for (i = 0; i < n; i++) {
+		INIT_LISTENTRY(&j.j_tasks[i].t_lentry);
+		j.j_tasks[i].t_job = &j;
+		lc_add(&cksumq, &j.j_tasks[i]);
+	}
+
+	if (base == NULL)
+		buf = PSCALLOC(leafsz);
+	cksum_run(&j, buf);
+	PSCFREE(buf);
+
+	spinlock(&j.j_lock);
+	while (j.j_nhelpers) {
+		psc_waitq_wait(&j.j_wq, &j.j_lock);
+		spinlock(&j.j_lock);
+	}
+	freelock(&j.j_lock);
+
+	if (j.j_error) {
+		PSCFREE(j.j_leaves);
+		errno = j.j_error;
+		return (NULL);
+	}
+	return (j.j_leaves);
+}
+
+/*
+ * Number of nodes of height @level in the tree over @nleaves leaves.
+ */
+uint64_t
+cksum_nnodes(uint64_t nleaves, int level)
+{
+	while (level-- > 0)
+		nleaves = howmany(nleaves, CKTREE_FANOUT);
+	return (nleaves);
+}
+
+int
+cksum_height(uint64_t nleaves)
+{
+	int h;
+
+	for (h = 0; nleaves > 1; h++)
+		nleaves = howmany(nleaves, CKTREE_FANOUT);
+	return (h);
+}
+
+/*
+ * Compute node @idx of height @level into @out.  A node is the digest
+ * of the digests of its children; the last node of a level may have
+ * fewer than the others.
+ */
+void
+cksum_node(const unsigned char *leaves, uint64_t nleaves, int level,
+    uint64_t idx, unsigned char *out)
+{
+	unsigned char sub[CKTREE_FANOUT * ALGLEN];
+	uint64_t i, n;
+	int k;
+
+	if (level == 0) {
+		memcpy(out, leaves + idx * ALGLEN, ALGLEN);
+		return;
+	}
+
+	n = cksum_nnodes(nleaves, level - 1);
+	for (i = idx * CKTREE_FANOUT, k = 0;
+	    k < CKTREE_FANOUT && i < n; i++, k++)
+		cksum_node(leaves, nleaves, level - 1, i, sub + k * ALGLEN);
+	digest_buf(sub, k * ALGLEN, out);
+}
+
+#define CKCACHE_XATTR		"user.psync.cksum"
+#define CKCACHE_MAGIC		0x70736331	/* "psc1" */
+#define CKCACHE_MAXSZ		(64 * 1024)	/* XATTR_SIZE_MAX */
+#define CKCACHE_NAMELEN		38		/* %016x.%016x.tmp + NUL */
+
+/* precedes the chunk digests of a cache entry */
+struct ckcache_hdr {
+	uint32_t		ch_magic;
+	char			ch_alg[12];	/* digest_name() */
+	uint64_t		ch_dev;
+	uint64_t		ch_ino;
+	uint64_t		ch_size;
+	 int64_t		ch_mtime;
+	 int64_t		ch_mtime_ns;
+	uint64_t		ch_leafsz;
+};
+
+/*
+ * The header a cache entry for the file of @stb must carry to be
+ * trusted.  Any write to the file since moves its mtime on.
+ */
+void
+cksum_cache_hdr(struct ckcache_hdr *ch, const struct stat *stb,
+    size_t leafsz)
+{
+	memset(ch, 0, sizeof(*ch));
+	ch->ch_magic = CKCACHE_MAGIC;
+	strncpy(ch->ch_alg, digest_name(), sizeof(ch->ch_alg) - 1);
+	ch->ch_dev = stb->st_dev;
+	ch->ch_ino = stb->st_ino;
+	ch->ch_size = stb->st_size;
+	PFL_STB_MTIME_GET(stb, &ch->ch_mtime, &ch->ch_mtime_ns);
+	ch->ch_leafsz = leafsz;
+}
+
+/*
+ * Return a descriptor on the directory in the destination root holding
+ * the entries of files too large for an attribute, or -1 if there is
+ * none.  It is only looked for once, and only created by @create,
+ * when an entry has to be written there.
+ */
+int
+cksum_cachedir(int create)
+{
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	static psc_atomic32_t dfd = PSC_ATOMIC32_INIT(-1);
+	static psc_atomic32_t looked = PSC_ATOMIC32_INIT(0);
+	int fd;
+
+	fd = psc_atomic32_read(&dfd);
+	if (fd != -1 || (!create && psc_atomic32_read(&looked)))
+		return (fd);
+
+	pthread_mutex_lock(&mutex);
+	fd = psc_atomic32_read(&dfd);
+	if (fd == -1 && (!psc_atomic32_read(&looked) || create)) {
+		if (create && mkdir(CKCACHE_DIR, 0700) == -1 &&
+		    errno != EEXIST)
+			psynclog_warn("mkdir %s", CKCACHE_DIR);
+		fd = open(CKCACHE_DIR, O_RDONLY | O_DIRECTORY);
+		psc_atomic32_set(&dfd, fd);
+		psc_atomic32_set(&looked, 1);
+	}
+	pthread_mutex_unlock(&mutex);
+	return (fd);
+}
+
+/*
+ * Whether a path found by a walk lies within CKCACHE_DIR, which is not
+ * to be sent on should the destination serve as a source.
+ */
+int
+cksum_cache_skip(const char *fn)
+{
+	size_t len = sizeof(CKCACHE_DIR) - 1;
+	const char *p;
+
+	for (p = fn; (p = strstr(p, CKCACHE_DIR)) != NULL; p++)
+		if ((p == fn || p[-1] == '/') &&
+		    (p[len] == '\0' || p[len] == '/'))
+			return (1);
+	return (0);
+}
+
+/* entries in CKCACHE_DIR are named by device and inode */
+void
+cksum_cache_name(char *name, const struct stat *stb)
+{
+	snprintf(name, CKCACHE_NAMELEN, "%016"PRIx64".%016"PRIx64,
+	    (uint64_t)stb->st_dev, (uint64_t)stb->st_ino);
+}
+
+/*
+ * Fetch the chunk digests of the file open on @fd from its cache
+ * entry, its attribute or, when too large for one, a file in
+ * CKCACHE_DIR.  Returns NULL if there is none or it is out of date.
+ */
+unsigned char *
+cksum_cache_get(int fd, const struct stat *stb, size_t leafsz)
+{
+	char *buf, name[CKCACHE_NAMELEN];
+	unsigned char *leaves = NULL;
+	struct ckcache_hdr want;
+	ssize_t rc = -1;
+	int cfd, dfd;
+	size_t len;
+
+	len = sizeof(want) + howmany(stb->st_size, leafsz) * ALGLEN;
+	cksum_cache_hdr(&want, stb, leafsz);
+	buf = PSCALLOC(len);
+	if (len <= CKCACHE_MAXSZ)
+		rc = fgetxattr(fd, CKCACHE_XATTR, buf, len);
+	else if ((dfd = cksum_cachedir(0)) != -1) {
+		cksum_cache_name(name, stb);
+		cfd = openat(dfd, name, O_RDONLY);
+		if (cfd != -1) {
+			rc = pread(cfd, buf, len, 0);
+			close(cfd);
+		}
+	}
+	if (rc == (ssize_t)len && memcmp(buf, &want, sizeof(want)) == 0) {
+		leaves = PSCALLOC(len - sizeof(want));
+		memcpy(leaves, buf + sizeof(want), len - sizeof(want));
+	}
+	PSCFREE(buf);
+	return (leaves);
+}
+
+/*
+ * Store the chunk digests of the file open on @fd.  Entries too large
+ * for an attribute go to CKCACHE_DIR; file systems without room for the
+ * attribute simply go without.
+ */
+void
+cksum_cache_write(int fd, const struct stat *stb,
+    const unsigned char *leaves, size_t leafsz)
+{
+	char *buf, name[CKCACHE_NAMELEN], tmpname[CKCACHE_NAMELEN];
+	struct ckcache_hdr *ch;
+	int cfd, dfd;
+	size_t len;
+
+	len = sizeof(*ch) + howmany(stb->st_size, leafsz) * ALGLEN;
+	buf = PSCALLOC(len);
+	ch = (void *)buf;
+	cksum_cache_hdr(ch, stb, leafsz);
+	memcpy(buf + sizeof(*ch), leaves, len - sizeof(*ch));
+	if (len <= CKCACHE_MAXSZ) {
+		if (fsetxattr(fd, CKCACHE_XATTR, buf, len, 0) == -1)
+			psynclog_diag("fsetxattr: %s", strerror(errno));
+		goto out;
+	}
+
+	dfd = cksum_cachedir(1);
+	if (dfd == -1)
+		goto out;
+	cksum_cache_name(name, stb);
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+	cfd = openat(dfd, tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (cfd == -1 || pwrite(cfd, buf, len, 0) != (ssize_t)len ||
+	    renameat(dfd, tmpname, dfd, name) == -1) {
+		psynclog_warn("%s/%s", CKCACHE_DIR, name);
+		unlinkat(dfd, tmpname, 0);
+	}
+	if (cfd != -1)
+		close(cfd);
+ out:
+	PSCFREE(buf);
+}
+
+/*
+ * The file open on @fd is being replaced; forget its entry in
+ * CKCACHE_DIR.  An attribute goes away with the file.
+ */
+void
+cksum_cache_drop(int fd)
+{
+	char name[CKCACHE_NAMELEN];
+	struct stat stb;
+	int dfd;
+
+	dfd = cksum_cachedir(0);
+	if (dfd == -1 || fstat(fd, &stb) == -1)
+		return;
+	cksum_cache_name(name, &stb);
+	unlinkat(dfd, name, 0);
+}
+
+/*
+ * Get ready to hash the chunks of @leafsz bytes of a file of @size
+ * bytes as they are written, for its cache entry.
+ */
+void
+cksum_cache_expect(struct file *f, off_t size, size_t leafsz)
+{
+	unsigned char *cnew, *ok;
+	uint64_t n;
+
+	if (!opts.checksum_cache || leafsz == 0 || size == 0)
+		return;
+
+	n = howmany(size, leafsz);
+	cnew = PSCALLOC(n * ALGLEN);
+	ok = PSCALLOC(n);
+
+	spinlock(&f->lock);
+	if (f->ck_new == NULL) {
+		f->ck_new = cnew;
+		f->ck_newok = ok;
+		f->ck_newsize = size;
+		f->ck_newleafsz = leafsz;
+		cnew = ok = NULL;
+	}
+	freelock(&f->lock);
+	PSCFREE(cnew);
+	PSCFREE(ok);
+}
+
+/*
+ * Store the chunk digests of a completed file, open on @fd, provided
+ * all of them are known.
+ */
+void
+cksum_cache_put(struct file *f, int fd)
+{
+	struct stat stb;
+	uint64_t i, n;
+
+	if (f->ck_new == NULL)
+		return;
+	if (fstat(fd, &stb) == -1 || stb.st_size != f->ck_newsize)
+		return;
+	n = howmany(f->ck_newsize, f->ck_newleafsz);
+	for (i = 0; i < n; i++)
+		if (!f->ck_newok[i])
+			return;
+	cksum_cache_write(fd, &stb, f->ck_new, f->ck_newleafsz);
+}
+
+/*
+ * Hash the basis of a file being received, once for all the GETCKSUM
+ * requests walking its tree, unless its digests are cached.  Returns
+ * zero or an errno.
+ */
+int
+cksum_basis(struct file *f, size_t leafsz)
+{
+	unsigned char *leaves = NULL;
+	struct stat stb;
+	uint64_t n;
+	int have;
+
+	spinlock(&f->lock);
+	have = f->ck_leaves != NULL;
+	freelock(&f->lock);
+	if (have)
+		return (f->ck_leafsz == leafsz ? 0 : EINVAL);
+
+	if (f->basefd == -1)
+		return (ENOENT);
+	if (fstat(f->basefd, &stb) == -1)
+		return (errno);
+	if (opts.checksum_cache)
+		leaves = cksum_cache_get(f->basefd, &stb, leafsz);
+	if (leaves == NULL)
+		leaves = cksum_leaves(f->basefd, NULL, stb.st_size, leafsz);
+	if (leaves == NULL)
+		return (errno);
+
+	n = howmany(stb.st_size, leafsz);
+	spinlock(&f->lock);
+	if (f->ck_leaves == NULL) {
+		f->ck_leaves = leaves;
+		f->ck_nleaves = n;
+		f->ck_leafsz = leafsz;
+		if (f->ck_new && f->ck_newleafsz == leafsz &&
+		    f->ck_newsize == stb.st_size) {
+			/* unchanged chunks are copied from the basis */
+			memcpy(f->ck_new, leaves, n * ALGLEN);
+			memset(f->ck_newok, 1, n);
+		}
+		leaves = NULL;
+	}
+	freelock(&f->lock);
+	PSCFREE(leaves);
+	return (f->ck_leafsz == leafsz ? 0 : EINVAL);
+}
+
+/*
+ * Keep the digests of a file being received up to date as data @p of
+ * @len bytes lands at @off.  With @p NULL, or data not made of whole
+ * chunks, the chunks touched are no longer known.
+ */
+void
+cksum_update(struct file *f, off_t off, const void *p, size_t len)
+{
+	unsigned char *cnew;
+	size_t leafsz, n;
+	uint64_t idx;
+
+	spinlock(&f->lock);
+	cnew = f->ck_new;
+	freelock(&f->lock);
+	if (cnew == NULL || len == 0)
+		return;
+
+	leafsz = f->ck_newleafsz;
+	idx = off / leafsz;
+	if (p && off % leafsz == 0 && off + (off_t)len <= f->ck_newsize &&
+	    (len % leafsz == 0 || off + (off_t)len == f->ck_newsize)) {
+		for (; len; idx++, len -= n) {
+			n = MIN(len, leafsz);
+			digest_buf(p, n, cnew + idx * ALGLEN);
+			f->ck_newok[idx] = 1;
+			p = (const char *)p + n;
+		}
+		return;
+	}
+	for (; idx < howmany(f->ck_newsize, leafsz) &&
+	    (off_t)(idx * leafsz) < off + (off_t)len; idx++)
+		f->ck_newok[idx] = 0;
+}
+
+struct cktree *
+cktree_new(off_t size, size_t leafsz)
+{
+	struct cktree *ct;
+
+	ct = PSCALLOC(sizeof(*ct));
+	INIT_SPINLOCK(&ct->ct_lock);
+	ct->ct_size = size;
+	ct->ct_leafsz = leafsz;
+	ct->ct_nleaves = howmany(size, leafsz);
+	ct->ct_height = cksum_height(ct->ct_nleaves);
+	return (ct);
+}
+
+void
+cktree_free(struct cktree *ct)
+{
+	PSCFREE(ct->ct_leaves);
+	PSCFREE(ct->ct_early);
+	PSCFREE(ct);
+}
@@ -0,0 +1,293 @@
+/* $Id$ */
+/*
+ * %PSC_START_COPYRIGHT%
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2011-2015, Pittsburgh Supercomputing Center (PSC).
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Pittsburgh Supercomputing Center	phone: 412.268.4960  fax: 412.268.5832
+ * 300 S. Craig Street			e-mail: remarks@psc.edu
+ * Pittsburgh, PA 15213			web: http://www.psc.edu/
+ * -----------------------------------------------------------------------------
+ * %PSC_END_COPYRIGHT%
+ */
+
+/*
+ * Delta transfers.  The receiver signs each block of the version of a
+ * file it already has with a weak rolling checksum and a strong digest.
+ * The sender slides a window of the same size over the new contents a
+ * byte at a time, looking the weak sum up in an index of the basis
+ * blocks, and sends references to the blocks found instead of their
+ * data.  Only the bytes in between are sent as is.
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pfl/alloc.h"
+#include "pfl/atomic.h"
+#include "pfl/lock.h"
+
+#include "psync.h"
+#include "rpc.h"
+
+struct rollsum {
+	uint32_t		rs_a;
+	uint32_t		rs_b;
+};
+
+#define rollsum_get(rs)		(((rs)->rs_a & 0xffff) | ((rs)->rs_b << 16))
+
+/* index buckets are picked by the high bits of a multiplicative hash */
+#define DELTA_HASH(d, weak)	((uint32_t)((weak) * 2654435761U) >>	\
+				    (d)->d_tabshift)
+
+psc_atomic64_t			delta_nliteral = PSC_ATOMIC64_INIT(0);
+psc_atomic64_t			delta_nmatched = PSC_ATOMIC64_INIT(0);
+
+void
+rollsum_init(struct rollsum *rs, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	rs->rs_a = rs->rs_b = 0;
+	for (i = 0; i < len; i++) {
+		rs->rs_a += p[i];
+		rs->rs_b += rs->rs_a;
+	}
+}
+
+/*
+ * Slide a window of @len bytes forward by one byte, dropping @out and
+ * taking in @in.
+ */
+#define rollsum_roll(rs, out, in, len)					\
+	do {								\
+		(rs)->rs_a += (in) - (out);				\
+		(rs)->rs_b += (rs)->rs_a - (uint32_t)(len) * (out);	\
+	} while (0)
+
+/*
+ * Set up for sending a file of @size bytes.  The block size grows with
+ * the file to bound the number of signatures; the basis size is not
+ * known yet, so this assumes the two are about the same.
+ */
+struct delta *
+delta_new(off_t size, size_t sendsz)
+{
+	struct delta *d;
+	size_t blksz;
+
+	blksz = roundup(size / DELTA_NBLKS, 4096);
+	blksz = MAX(blksz, DELTA_MINBLKSZ);
+	blksz = MIN(blksz, DELTA_MAXBLKSZ);
+
+	d = PSCALLOC(sizeof(*d));
+	INIT_SPINLOCK(&d->d_lock);
+	d->d_blksz = blksz;
+	d->d_sendsz = sendsz;
+	d->d_size = size;
+	return (d);
+}
+
+void
+delta_free(struct delta *d)
+{
+	PSCFREE(d->d_sigs);
+	PSCFREE(d->d_tab);
+	PSCFREE(d->d_next);
+	PSCFREE(d);
+}
+
+void
+delta_setbasis(struct delta *d, off_t basesize)
+{
+	d->d_basesize = basesize;
+	d->d_nblks = howmany(basesize, d->d_blksz);
+	d->d_nfull = basesize / d->d_blksz;
+	d->d_sigs = PSCALLOC(d->d_nblks * sizeof(*d->d_sigs));
+}
+
+/*
+ * Hash the weak sums of the basis blocks.  A short block at the end of
+ * the basis can only match at the end of the file and is left out.
+ */
+void
+delta_index(struct delta *d)
+{
+	uint32_t i, h;
+	int bits;
+
+	for (bits = 1; (1U << bits) < 2 * d->d_nfull && bits < 31; bits++)
+		;
+	d->d_tabshift = 32 - bits;
+	d->d_tab = PSCALLOC(sizeof(*d->d_tab) << bits);
+	d->d_next = PSCALLOC(MAX(d->d_nfull, 1) * sizeof(*d->d_next));
+
+	/* walk backwards so chains prefer earlier blocks */
+	for (i = d->d_nfull; i > 0; i--) {
+		h = DELTA_HASH(d, d->d_sigs[i - 1].weak);
+		d->d_next[i - 1] = d->d_tab[h];
+		d->d_tab[h] = i;
+	}
+}
+
+/*
+ * Sign the blocks of a range of basis file @fd into @sigs.  @buf must
+ * hold @blksz bytes.  Returns the number of blocks or -1 on error.
+ */
+int
+delta_sign(int fd, off_t off, size_t len, size_t blksz,
+    struct rpc_blksig *sigs, void *buf)
+{
+	struct rollsum rs;
+	ssize_t rc;
+	size_t n;
+	int nblks;
+
+	for (nblks = 0; len; nblks++) {
+		n = MIN(len, blksz);
+		rc = pread(fd, buf, n, off);
+		if (rc == -1)
+			return (-1);
+		if ((size_t)rc != n) {
+			/* basis shrank underneath us */
+			errno = EIO;
+			return (-1);
+		}
+		rollsum_init(&rs, buf, n);
+		sigs[nblks].weak = rollsum_get(&rs);
+		digest_buf(buf, n, sigs[nblks].strong);
+		off += n;
+		len -= n;
+	}
+	return (nblks);
+}
+
+/*
+ * Find a basis block holding the window at @p.  The block following
+ * the previous match, @hint, is tried first since unchanged regions
+ * run over many blocks.  Returns the block or -1.
+ */
+int64_t
+delta_find(struct delta *d, uint32_t weak, const unsigned char *p,
+    int64_t hint)
+{
+	unsigned char strong[ALGLEN];
+	int have = 0;
+	uint32_t i;
+
+	if (hint >= 0 && hint < d->d_nfull &&
+	    d->d_sigs[hint].weak == weak) {
+		digest_buf(p, d->d_blksz, strong);
+		have = 1;
+		if (memcmp(strong, d->d_sigs[hint].strong, ALGLEN) == 0)
+			return (hint);
+	}
+	for (i = d->d_tab[DELTA_HASH(d, weak)]; i; i = d->d_next[i - 1]) {
+		if (d->d_sigs[i - 1].weak != weak)
+			continue;
+		if (!have) {
+			digest_buf(p, d->d_blksz, strong);
+			have = 1;
+		}
+		if (memcmp(strong, d->d_sigs[i - 1].strong, ALGLEN) == 0)
+			return (i - 1);
+	}
+	return (-1);
+}
+
+void
+delta_literal(struct delta *d, struct stream *st, uint64_t fid,
+    const char *base, off_t off, off_t end, int srcfd)
+{
+	size_t len;
+
+	for (; off < end; off += len) {
+		len = MIN((size_t)(end - off), d->d_sendsz);
+		rpc_send_putdata(st, fid, off, base + off, len, 0, srcfd);
+		psc_atomic64_inc(&d->d_npieces);
+		psc_atomic64_add(&delta_nliteral, len);
+	}
+}
+
+void
+delta_copy(struct delta *d, struct stream *st, uint64_t fid,
+    off_t off, off_t srcoff, size_t len)
+{
+	if (len == 0)
+		return;
+	rpc_send_putcopy(st, fid, off, srcoff, len);
+	psc_atomic64_inc(&d->d_npieces);
+	psc_atomic64_add(&delta_nmatched, len);
+}
+
+/*
+ * Send [@off, @end) of the file mapped at @base as a delta.  Runs of
+ * consecutive basis blocks go out as one copy and literal data in
+ * chunks of up to d_sendsz.  Matches do not cross @end, so segments
+ * should be large compared to the block size.
+ */
+void
+delta_scan(struct delta *d, struct stream *st, uint64_t fid,
+    const char *base, off_t off, off_t end, int srcfd)
+{
+	const unsigned char *p = (const unsigned char *)base;
+	off_t pos, lit, cpos = 0, csrc = 0, clen = 0;
+	off_t bs = d->d_blksz;
+	struct rollsum rs;
+	int64_t blk, hint = -1;
+
+	pos = lit = off;
+	if (end - pos >= bs)
+		rollsum_init(&rs, p + pos, bs);
+	while (end - pos >= bs) {
+		blk = delta_find(d, rollsum_get(&rs), p + pos, hint);
+		if (blk >= 0) {
+			delta_literal(d, st, fid, base, lit, pos, srcfd);
+			if (clen && cpos + clen == pos &&
+			    csrc + clen == blk * bs)
+				clen += bs;
+			else {
+				delta_copy(d, st, fid, cpos, csrc, clen);
+				cpos = pos;
+				csrc = blk * bs;
+				clen = bs;
+			}
+			hint = blk + 1;
+			pos += bs;
+			lit = pos;
+			if (end - pos >= bs)
+				rollsum_init(&rs, p + pos, bs);
+			continue;
+		}
+
+		if (end - pos > bs)
+			rollsum_roll(&rs, p[pos], p[pos + bs], bs);
+		pos++;
+		hint = -1;
+		if (pos - lit >= (off_t)d->d_sendsz) {
+			delta_literal(d, st, fid, base, lit, pos, srcfd);
+			lit = pos;
+		}
+	}
+	delta_copy(d, st, fid, cpos, csrc, clen);
+	delta_literal(d, st, fid, base, lit, end, srcfd);
+}
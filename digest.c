@@ -0,0 +1,323 @@
+/* $Id$ */
+/*
+ * %PSC_START_COPYRIGHT%
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2011-2015, Pittsburgh Supercomputing Center (PSC).
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Pittsburgh Supercomputing Center	phone: 412.268.4960  fax: 412.268.5832
+ * 300 S. Craig Street			e-mail: remarks@psc.edu
+ * Pittsburgh, PA 15213			web: http://www.psc.edu/
+ * -----------------------------------------------------------------------------
+ * %PSC_END_COPYRIGHT%
+ */
+
+/*
+ * Digests of file data for --checksum and --delta.  Both sides must
+ * use the same algorithm, so it is the first in order of preference
+ * that both support, settled as the READY messages are exchanged,
+ * unless given with --digest.  SHA-256 is always there to fall back
+ * on.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gcrypt.h>
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+#include "pfl/alloc.h"
+#include "pfl/atomic.h"
+#include "pfl/completion.h"
+
+#include "options.h"
+#include "psync.h"
+#include "rpc.h"
+
+#define DIGEST_BENCHSZ		(64 * 1024 * 1024)
+
+struct digest_alg {
+	const char		*da_name;
+	void			(*da_fn)(const void *, size_t,
+				    unsigned char *);
+};
+
+/* libgcrypt handles are kept per thread and reset between uses */
+struct digest_tls {
+	gcry_md_hd_t		 dt_hd[NDIGESTS];
+};
+
+void	digest_sha256(const void *, size_t, unsigned char *);
+void	digest_blake2b(const void *, size_t, unsigned char *);
+void	digest_blake3(const void *, size_t, unsigned char *);
+void	digest_xxh128(const void *, size_t, unsigned char *);
+
+struct digest_alg digest_algs[NDIGESTS] = {
+	[DIGEST_SHA256]		= { "sha256",	digest_sha256 },
+#if GCRYPT_VERSION_NUMBER >= 0x010800
+	[DIGEST_BLAKE2B]	= { "blake2b",	digest_blake2b },
+#else
+	[DIGEST_BLAKE2B]	= { "blake2b",	NULL },
+#endif
+#ifdef HAVE_BLAKE3
+	[DIGEST_BLAKE3]		= { "blake3",	digest_blake3 },
+#else
+	[DIGEST_BLAKE3]		= { "blake3",	NULL },
+#endif
+#ifdef HAVE_XXHASH
+	[DIGEST_XXH128]		= { "xxh128",	digest_xxh128 },
+#else
+	[DIGEST_XXH128]		= { "xxh128",	NULL },
+#endif
+};
+
+/* fastest first */
+int digest_pref[] = {
+	DIGEST_XXH128,
+	DIGEST_BLAKE3,
+	DIGEST_BLAKE2B,
+	DIGEST_SHA256
+};
+
+pthread_key_t		 digest_key;
+int			 digest_sel = DIGEST_SHA256;
+psc_atomic32_t		 digest_settled = PSC_ATOMIC32_INIT(0);
+
+void
+digest_tls_free(void *arg)
+{
+	struct digest_tls *dt = arg;
+	int i;
+
+	for (i = 0; i < NDIGESTS; i++)
+		if (dt->dt_hd[i])
+			gcry_md_close(dt->dt_hd[i]);
+	PSCFREE(dt);
+}
+
+void
+digest_gcry(int d, int algo, const void *p, size_t len,
+    unsigned char *out)
+{
+	struct digest_tls *dt;
+	gcry_error_t gerr;
+	gcry_md_hd_t hd;
+
+	dt = pthread_getspecific(digest_key);
+	if (dt == NULL) {
+		dt = PSCALLOC(sizeof(*dt));
+		pthread_setspecific(digest_key, dt);
+	}
+	hd = dt->dt_hd[d];
+	if (hd == NULL) {
+		gerr = gcry_md_open(&hd, algo, 0);
+		if (gerr)
+			psync_fatalx("gcry_md_open: error=%d", gerr);
+		dt->dt_hd[d] = hd;
+	} else
+		gcry_md_reset(hd);
+	gcry_md_write(hd, p, len);
+	memcpy(out, gcry_md_read(hd, algo), ALGLEN);
+}
+
+void
+digest_sha256(const void *p, size_t len, unsigned char *out)
+{
+	digest_gcry(DIGEST_SHA256, GCRY_MD_SHA256, p, len, out);
+}
+
+#if GCRYPT_VERSION_NUMBER >= 0x010800
+void
+digest_blake2b(const void *p, size_t len, unsigned char *out)
+{
+	digest_gcry(DIGEST_BLAKE2B, GCRY_MD_BLAKE2B_256, p, len, out);
+}
+#endif
+
+#ifdef HAVE_BLAKE3
+void
+digest_blake3(const void *p, size_t len, unsigned char *out)
+{
+	blake3_hasher h;
+
+	blake3_hasher_init(&h);
+	blake3_hasher_update(&h, p, len);
+	blake3_hasher_finalize(&h, out, ALGLEN);
+}
+#endif
+
+#ifdef HAVE_XXHASH
+void
+digest_xxh128(const void *p, size_t len, unsigned char *out)
+{
+	XXH128_canonical_t c;
+
+	XXH128_canonicalFromHash(&c, XXH3_128bits(p, len));
+	memcpy(out, &c, sizeof(c));
+	memset(out + sizeof(c), 0, ALGLEN - sizeof(c));
+}
+#endif
+
+void
+digest_init(void)
+{
+	int rc;
+
+	rc = pthread_key_create(&digest_key, digest_tls_free);
+	if (rc)
+		psync_fatalx("pthread_key_create: %s", strerror(rc));
+}
+
+/*
+ * Wait for the algorithm to be settled.  The puppet only learns it
+ * from the master's READY on the first stream, while requests needing
+ * it may already come in on the others.
+ */
+void
+digest_wait(void)
+{
+	if (psc_atomic32_read(&digest_settled) == 0) {
+		psc_compl_wait(&psync_ready);
+		psc_atomic32_set(&digest_settled, 1);
+	}
+}
+
+/*
+ * Digest @len bytes at @p into the ALGLEN bytes at @out with the
+ * algorithm in use; shorter digests are padded with zeros.
+ */
+void
+digest_buf(const void *p, size_t len, unsigned char *out)
+{
+	digest_wait();
+	digest_algs[digest_sel].da_fn(p, len, out);
+}
+
+/*
+ * Bitmask of the algorithms available here, for READY.
+ */
+uint32_t
+digest_mask(void)
+{
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < NDIGESTS; i++)
+		if (digest_algs[i].da_fn)
+			mask |= 1 << i;
+	return (mask);
+}
+
+int
+digest_byname(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NDIGESTS; i++)
+		if (strcmp(name, digest_algs[i].da_name) == 0)
+			return (i);
+	return (-1);
+}
+
+const char *
+digest_byid(int d)
+{
+	return (digest_algs[d].da_name);
+}
+
+/* the algorithm in use, only settled once READY is received */
+const char *
+digest_name(void)
+{
+	digest_wait();
+	return (digest_byid(digest_sel));
+}
+
+/*
+ * Settle on an algorithm given what the peer supports.  This has to
+ * come out the same on both sides: --digest is passed on to the
+ * puppet, and peers predating this announce nothing.
+ */
+void
+digest_negotiate(uint32_t peer)
+{
+	uint32_t common;
+	size_t i;
+
+	common = digest_mask() & (peer | 1 << DIGEST_SHA256);
+	if (opts.digest != -1) {
+		if (common & (1 << opts.digest)) {
+			digest_sel = opts.digest;
+			return;
+		}
+		psynclog_warnx("digest %s not supported by both sides",
+		    digest_algs[opts.digest].da_name);
+	}
+	for (i = 0; i < nitems(digest_pref); i++)
+		if (common & (1 << digest_pref[i])) {
+			digest_sel = digest_pref[i];
+			break;
+		}
+}
+
+/*
+ * Print the algorithms built in along with how fast one thread hashes
+ * with each, for --digest=list.
+ */
+void
+digest_list(FILE *fp)
+{
+	unsigned char out[ALGLEN];
+	struct timespec t0, t1;
+	double secs;
+	char *buf;
+	int i, n;
+
+	digest_init();
+	buf = PSCALLOC(DIGEST_BENCHSZ);
+	for (i = 0; i < DIGEST_BENCHSZ; i++)
+		buf[i] = random();
+
+	for (i = 0; i < NDIGESTS; i++) {
+		if (digest_algs[i].da_fn == NULL) {
+			fprintf(fp, "%-8s  not built in\n",
+			    digest_algs[i].da_name);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (n = 0; n < 4; n++)
+			digest_algs[i].da_fn(buf, DIGEST_BENCHSZ, out);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		secs = t1.tv_sec - t0.tv_sec +
+		    (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+		fprintf(fp, "%-8s  %8.1f MiB/s per thread\n",
+		    digest_algs[i].da_name, n * DIGEST_BENCHSZ /
+		    (1024. * 1024) / secs);
+	}
+	PSCFREE(buf);
+}
@@ -31,167 +31,639 @@
  */
 
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
 #include "pfl/alloc.h"
-#include "pfl/hashtbl.h"
+#include "pfl/atomic.h"
+#include "pfl/dynarray.h"
+#include "pfl/list.h"
+#include "pfl/listcache.h"
+#include "pfl/pool.h"
 #include "pfl/str.h"
+#include "pfl/thread.h"
 #include "pfl/walk.h"
 
 #include "psync.h"
 #include "options.h"
 
-struct psc_hashtbl	 fcache;
+#define MAX_AIOTHRS		8
+#define NFINTHRS		4
+
+#define FCACHE_STRIPEBITS	6
+#define FCACHE_NSTRIPES		(1 << FCACHE_STRIPEBITS)
+#define FCACHE_MINBKTS		64		/* per stripe */
+#define FCACHE_MAXFDS		(1 << 20)
+#define FCACHE_RSVFDS		64
+
+struct fcache_stripe {
+	psc_spinlock_t		 fs_lock;
+	struct file		**fs_bkts;
+	size_t			 fs_nbkts;	/* power of two */
+	size_t			 fs_nents;
+};
+
+struct fcache_stripe	 fcache[FCACHE_NSTRIPES];
+struct psclist_head	 fcache_idle = PSCLIST_HEAD_INIT(fcache_idle);
+psc_spinlock_t		 fcache_idlelock = SPINLOCK_INIT;
+struct psc_waitq	 fcache_waitq = PSC_WAITQ_INIT;
+psc_atomic32_t		 fcache_nfds = PSC_ATOMIC32_INIT(0);
+psc_atomic64_t		 fcache_nreopens = PSC_ATOMIC64_INIT(0);
+int			 fcache_maxfds;
+
+struct psc_listcache	 finq;			/* completed files */
+psc_atomic32_t		 fin_pending = PSC_ATOMIC32_INIT(0);
+
+struct psc_poolmaster	 wrbuf_poolmaster;
+struct psc_poolmgr	*wrbuf_pool;
+struct psc_listcache	 aioq;
+psc_atomic32_t		 aio_inflight = PSC_ATOMIC32_INIT(0);
 
+psc_atomic64_t		 io_nwrites = PSC_ATOMIC64_INIT(0);
+psc_atomic64_t		 io_nwbytes = PSC_ATOMIC64_INIT(0);
+
+struct psc_dynarray	 coal_files = DYNARRAY_INIT;	/* holding data */
+psc_spinlock_t		 coal_lock = SPINLOCK_INIT;
+psc_atomic64_t		 coal_mem = PSC_ATOMIC64_INIT(0);
+
+#ifdef HAVE_LIBURING
+struct io_uring		 aio_ring;
+pthread_mutex_t		 aio_ringlock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+int			 aio_usering;
+
+int			 objns_rootfd = -1;
+int			*objns_dirfds;
+int			 objns_ndirs;
+
+/*
+ * Create the object namespace along with all of its fan-out
+ * directories on first use and hold a descriptor on each, so objects
+ * are reached through the *at() calls without a mkdir(2) or a path
+ * walk per lookup.
+ *
+ * The depth is reduced when the descriptor limit is too low to afford
+ * all of the directories.
+ *
+ * With --tmpfile, files are created anonymous in the namespace root
+ * and there is nothing to fan out, provided the file system supports
+ * it.
+ */
 void
 objns_create(void)
 {
-	static psc_spinlock_t lock = SPINLOCK_INIT;
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	static psc_atomic32_t init = PSC_ATOMIC32_INIT(0);
+
+	char name[OBJNS_NAMELEN];
+	int i, n, fd, rootfd, *dirfds = NULL;
+
+	if (psc_atomic32_read(&init))
+		return;
 
-	spinlock(&lock);
-	if (objns_path[0] == '\0') {
+	pthread_mutex_lock(&mutex);
+	if (psc_atomic32_read(&init) == 0) {
 		snprintf(objns_path, sizeof(objns_path), ".psync.%d",
 		    opts.puppet);
 		if (mkdir(objns_path, 0700) == -1 && errno != EEXIST)
 			psync_fatal("mkdir %s", objns_path);
+		rootfd = open(objns_path, O_RDONLY | O_DIRECTORY);
+		if (rootfd == -1)
+			psync_fatal("open %s", objns_path);
+
+		if (opts.tmpfile) {
+#ifdef O_TMPFILE
+			fd = openat(rootfd, ".", O_TMPFILE | O_RDWR,
+			    0600);
+#else
+			fd = -1;
+			errno = ENOTSUP;
+#endif
+			if (fd == -1) {
+				psynclog_warn("%s: O_TMPFILE unavailable, "
+				    "using object namespace", objns_path);
+				opts.tmpfile = 0;
+			} else
+				close(fd);
+		}
+
+		/* the fan-out may take no more than half the budget */
+		while (opts.objns_depth > 1 &&
+		    1 << (4 * opts.objns_depth) > fcache_maxfds / 2)
+			opts.objns_depth--;
+		n = opts.tmpfile ? 0 : 1 << (4 * opts.objns_depth);
+		if (n)
+			dirfds = PSCALLOC(n * sizeof(*dirfds));
+		for (i = 0; i < n; i++) {
+			snprintf(name, sizeof(name), "%0*x",
+			    opts.objns_depth, i);
+			if (mkdirat(rootfd, name, 0700) == -1 &&
+			    errno != EEXIST)
+				psync_fatal("mkdir %s/%s", objns_path, name);
+			dirfds[i] = openat(rootfd, name,
+			    O_RDONLY | O_DIRECTORY);
+			if (dirfds[i] == -1)
+				psync_fatal("open %s/%s", objns_path, name);
+		}
+
+		objns_rootfd = rootfd;
+		objns_dirfds = dirfds;
+		objns_ndirs = n;
+		fcache_maxfds = MAX(fcache_maxfds - n - 1, FCACHE_RSVFDS);
+		psc_atomic32_set(&init, 1);
 	}
-	freelock(&lock);
+	pthread_mutex_unlock(&mutex);
 }
 
-void
-objns_makepath(char *fn, uint64_t fid)
+/*
+ * Return a descriptor on the object namespace directory holding fid
+ * and fill in the name of its object therein.
+ */
+int
+objns_lookup(uint64_t fid, char *name)
 {
-	static char objns_tab[] = "0123456789abcdef";
-	static int init;
+	objns_create();
+	snprintf(name, OBJNS_NAMELEN, "%016"PRIx64, fid);
+	return (objns_dirfds[(fid >> 8) & (objns_ndirs - 1)]);
+}
 
-	char *p;
-	int i;
+/*
+ * Keep another link to the basis of a file in the namespace root while
+ * its name is taken over by the new version, so that it can be put
+ * back should it turn out unchanged.
+ */
+int
+objns_stashbasis(uint64_t fid, const char *fn)
+{
+	char name[OBJNS_BASENAMELEN];
 
-	if (!init) {
-		objns_create();
-		init = 1;
-	}
+	objns_create();
+	snprintf(name, sizeof(name), "%016"PRIx64".base", fid);
+	unlinkat(objns_rootfd, name, 0);
+	return (linkat(AT_FDCWD, fn, objns_rootfd, name, 0));
+}
 
-	i = snprintf(fn, PATH_MAX, "%s/", objns_path);
-	/*
-	 * ensure name fits into:
-	 * <objns_dir>/abc/abcd0123abcd0123
-	 * length + 1 + depth + 1 + 16
-	 */
-	if (i == -1 || i >= PATH_MAX - (objns_depth + 2 + 16))
-		psync_fatal("snprintf");
-	p = fn + i;
+/*
+ * Create the file the contents of an inline PUTNAME are written to in
+ * the namespace root, to be renamed over its name once complete.
+ */
+int
+objns_inline(uint64_t fid, char *name)
+{
+	objns_create();
+	snprintf(name, OBJNS_BASENAMELEN, "%016"PRIx64".inl", fid);
+	return (openat(objns_rootfd, name, O_CREAT | O_TRUNC | O_WRONLY,
+	    0600));
+}
+
+/*
+ * Whether --tmpfile is in effect, which is only known once the
+ * namespace has been created and O_TMPFILE tried out.
+ */
+int
+objns_usetmpfile(void)
+{
+	objns_create();
+	return (opts.tmpfile);
+}
 
-	/* create a path */
-	for (i = 0; i < objns_depth; i++)
-		*p++ = objns_tab[(fid >> (4 * (i + 2))) & 0xf];
-	*p++ = '/';
-	*p = '\0';
+/*
+ * Give an anonymous --tmpfile file its name.  Linking by descriptor
+ * with AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, so fall back to going
+ * through /proc.  The name is kept so the file can be reopened should
+ * its descriptor be closed for the budget.
+ */
+int
+fcache_publish(struct file *f, const char *fn)
+{
+	char pfn[PATH_MAX];
+	int rc;
 
-	/* XXX could use a bitmap to skip this */
+	rc = linkat(f->fd, "", AT_FDCWD, fn, AT_EMPTY_PATH);
+	if (rc == -1 && errno == ENOENT) {
+		snprintf(pfn, sizeof(pfn), "/proc/self/fd/%d", f->fd);
+		rc = linkat(AT_FDCWD, pfn, AT_FDCWD, fn,
+		    AT_SYMLINK_FOLLOW);
+	}
+	if (rc == -1)
+		return (-1);
 
-	if (mkdir(fn, 0700) == -1 && errno != EEXIST)
-		psync_fatal("mkdir %s", fn);
+	spinlock(&f->lock);
+	PSCFREE(f->path);
+	f->path = pfl_strdup(fn);
+	f->flags &= ~FF_ANON;
+	freelock(&f->lock);
+	return (0);
+}
+
+/*
+ * The fcache is split into stripes by the high bits of the hashed file
+ * ID, each with its own lock and its own bucket array that is doubled
+ * whenever it averages more than one entry per bucket, so it scales
+ * from a handful of files to millions without tuning.
+ *
+ * Open descriptors are bounded by a budget derived from RLIMIT_NOFILE.
+ * Files not referenced by any in-flight work sit on an idle list and
+ * the least recently used is closed when the budget is reached; it is
+ * reopened through the object namespace on next use.
+ */
+uint64_t
+fcache_hash(uint64_t fid)
+{
+	return (fid * UINT64_C(0x9e3779b97f4a7c15));
+}
 
-	snprintf(p, PATH_MAX - (p - fn), "%016"PRIx64, fid);
+struct fcache_stripe *
+fcache_getstripe(uint64_t h)
+{
+	return (&fcache[h >> (64 - FCACHE_STRIPEBITS)]);
 }
 
 void
-_fcache_found(void *p, __unusedx void *arg)
+fcache_grow(struct fcache_stripe *s)
 {
-	struct file *f = p;
+	struct file **bkts, *f, *next;
+	size_t i, j, nbkts;
 
-	spinlock(&f->lock);
-	f->refcnt++;
+	spinlock(&s->fs_lock);
+	nbkts = s->fs_nbkts * 2;
+	freelock(&s->fs_lock);
+
+	/* allocate without holding up lookups in this stripe */
+	bkts = PSCALLOC(nbkts * sizeof(*bkts));
+
+	spinlock(&s->fs_lock);
+	if (s->fs_nbkts * 2 != nbkts || s->fs_nents <= s->fs_nbkts) {
+		/* someone else grew it */
+		freelock(&s->fs_lock);
+		PSCFREE(bkts);
+		return;
+	}
+	for (i = 0; i < s->fs_nbkts; i++)
+		for (f = s->fs_bkts[i]; f; f = next) {
+			next = f->next;
+			j = fcache_hash(f->fid) & (nbkts - 1);
+			f->next = bkts[j];
+			bkts[j] = f;
+		}
+	PSCFREE(s->fs_bkts);
+	s->fs_bkts = bkts;
+	s->fs_nbkts = nbkts;
+	freelock(&s->fs_lock);
 }
 
-struct file *
-fcache_search(uint64_t fid)
+/*
+ * Close the descriptor of the least recently used idle file.  Entries
+ * whose lock is busy are about to be used again, so skip over them.
+ */
+int
+fcache_evict(void)
 {
-	struct psc_hashbkt *b;
 	struct file *f;
+	int fd = -1;
 
-	f = psc_hashtbl_search_cb(&fcache, _fcache_found, NULL, &fid);
-	if (f)
-		goto out;
+	spinlock(&fcache_idlelock);
+	psclist_for_each_entry(f, &fcache_idle, lentry)
+		if (trylock(&f->lock)) {
+			psclist_del(&f->lentry, &fcache_idle);
+			f->flags &= ~FF_IDLE;
+			fd = f->fd;
+			f->fd = -1;
+			freelock(&f->lock);
+			break;
+		}
+	freelock(&fcache_idlelock);
+
+	if (fd == -1)
+		return (0);
+	close(fd);
+	psc_atomic32_dec(&fcache_nfds);
+	return (1);
+}
+
+int
+fcache_open(struct file *f, int reopen)
+{
+	char name[OBJNS_NAMELEN];
+	int dfd, fd = -1;
+
+	while (psc_atomic32_read(&fcache_nfds) >= fcache_maxfds)
+		if (!fcache_evict())
+			/* everything is in use; run over budget */
+			break;
+
+	objns_create();
+	if (f->path) {
+		fd = open(f->path, O_RDWR);
+		if (fd == -1)
+			psync_fatal("open %s", f->path);
+	} else if (opts.tmpfile) {
+#ifdef O_TMPFILE
+		fd = openat(objns_rootfd, ".", O_TMPFILE | O_RDWR, 0600);
+#endif
+		if (fd == -1)
+			psync_fatal("objns open %s", objns_path);
+	} else {
+		dfd = objns_lookup(f->fid, name);
+		fd = openat(dfd, name, O_RDWR | O_CREAT, 0600);
+		if (fd == -1)
+			psync_fatal("objns open %s", name);
+	}
+	psc_atomic32_inc(&fcache_nfds);
+	if (reopen)
+		psc_atomic64_inc(&fcache_nreopens);
+	return (fd);
+}
 
-	b = psc_hashbkt_get(&fcache, &fid);
-	f = psc_hashbkt_search_cb(&fcache, b, _fcache_found, NULL,
-	    &fid);
-	if (f == NULL) {
-		char fn[PATH_MAX];
+struct file *
+fcache_search(uint64_t fid)
+{
+	struct fcache_stripe *s;
+	struct file *f, **bkt;
+	int fd, grow = 0, reopen = 1;
+	uint64_t h;
 
+	h = fcache_hash(fid);
+	s = fcache_getstripe(h);
+
+	spinlock(&s->fs_lock);
+	bkt = &s->fs_bkts[h & (s->fs_nbkts - 1)];
+	for (f = *bkt; f; f = f->next)
+		if (f->fid == fid)
+			break;
+	if (f) {
+		spinlock(&f->lock);
+		if (f->refcnt++ == 0 && f->flags & FF_IDLE) {
+			spinlock(&fcache_idlelock);
+			psclist_del(&f->lentry, &fcache_idle);
+			freelock(&fcache_idlelock);
+			f->flags &= ~FF_IDLE;
+		}
+	} else {
 		//f = psc_pool_get(file_pool);
 		f = PSCALLOC(sizeof(*f));
 		INIT_SPINLOCK(&f->lock);
+		INIT_PSC_LISTENTRY(&f->lentry);
+		pthread_mutex_init(&f->cb_mutex, NULL);
+		f->fid = fid;
+		f->fd = -1;
+		f->basefd = -1;
 		f->refcnt = 1;
 		spinlock(&f->lock);
-		psc_hashent_init(&fcache, f);
-		f->fid = fid;
-
-		objns_makepath(fn, fid);
-		f->fd = open(fn, O_RDWR | O_CREAT, 0600);
-		if (f->fd == -1)
-			psync_fatal("%s", fn);
 
-		psc_hashbkt_add_item(&fcache, b, f);
+		f->next = *bkt;
+		*bkt = f;
+		grow = ++s->fs_nents > s->fs_nbkts;
+		reopen = 0;
 	}
-	psc_hashbkt_put(&fcache, b);
+	freelock(&s->fs_lock);
 
- out:
+	/* open the file without holding up the rest of the stripe */
+	while (f->fd == -1) {
+		if (f->flags & FF_OPENING) {
+			psc_waitq_wait(&fcache_waitq, &f->lock);
+			spinlock(&f->lock);
+			continue;
+		}
+		f->flags |= FF_OPENING;
+		freelock(&f->lock);
+
+		fd = fcache_open(f, reopen);
+
+		spinlock(&f->lock);
+		f->fd = fd;
+		f->flags &= ~FF_OPENING;
+		if (opts.tmpfile && f->path == NULL)
+			/* unnamed; cannot be reopened */
+			f->flags |= FF_ANON;
+		psc_waitq_wakeall(&fcache_waitq);
+	}
 	freelock(&f->lock);
+
+	if (grow)
+		fcache_grow(s);
 	return (f);
 }
 
+/*
+ * Keep the previous version of a file open as the --delta basis until
+ * the file is complete.  It counts against the descriptor budget.
+ * @fn is its name if it was stashed by objns_stashbasis().
+ */
 void
-fcache_close(struct file *f)
+fcache_setbasis(struct file *f, int fd, const char *fn)
+{
+	spinlock(&f->lock);
+	if (f->basefd != -1) {
+		close(f->basefd);
+		psc_atomic32_dec(&fcache_nfds);
+	}
+	f->basefd = fd;
+	PSCFREE(f->basefn);
+	f->basefn = fn ? pfl_strdup(fn) : NULL;
+	psc_atomic32_inc(&fcache_nfds);
+	freelock(&f->lock);
+}
+
+/*
+ * The basis of a file turned out to be unchanged: put it back in place
+ * of the new version, which is dropped.  Should it not have been
+ * stashed, it is copied into the new version instead.  Returns the
+ * number of chunks that took.
+ */
+uint64_t
+fcache_keepbasis(struct file *f, off_t size)
 {
-	struct psc_hashbkt *b;
+	char name[OBJNS_BASENAMELEN], objfn[OBJNS_NAMELEN];
+	int dfd, fd;
+
+	snprintf(name, sizeof(name), "%016"PRIx64".base", f->fid);
+	if (f->basefn == NULL ||
+	    renameat(objns_rootfd, name, AT_FDCWD, f->basefn) == -1) {
+		io_copy(f, 0, 0, size);
+		return (1);
+	}
+	if (!opts.tmpfile) {
+		/* further names of the file are linked from its object */
+		dfd = objns_lookup(f->fid, objfn);
+		unlinkat(dfd, objfn, 0);
+		if (linkat(AT_FDCWD, f->basefn, dfd, objfn, 0) == -1)
+			psynclog_warn("link %s", f->basefn);
+	}
 
-	b = psc_hashent_getbucket(&fcache, f);
 	spinlock(&f->lock);
-	if (--f->refcnt == 0 && (f->flags & (FF_SAWLAST | FF_LINKED)) ==
-	    (FF_SAWLAST | FF_LINKED) && f->nchunks == f->nchunks_seen) {
-		char objfn[PATH_MAX];
+	fd = f->fd;
+	f->fd = f->basefd;
+	f->basefd = -1;
+	PSCFREE(f->basefn);
+	freelock(&f->lock);
+	if (fd != -1) {
+		close(fd);
+		psc_atomic32_dec(&fcache_nfds);
+	}
+	return (0);
+}
 
-		objfn[0] = '\0';
+/*
+ * Apply the final times and modes to a completed file through its
+ * descriptor and close it.  Done by the finalizer threads so the
+ * thread dropping the last reference, usually a rcvthr, can go back
+ * to draining its stream.
+ */
+void
+fcache_finalize(struct file *f)
+{
+	char name[OBJNS_BASENAMELEN];
+	const char *fn;
+	int dfd, fd;
 
-		psc_hashent_remove(&fcache, f);
-		psynclog_diag("close fd=%d", f->fd);
-		if (opts.times) {
-			if (objfn[0] == '\0')
-				objns_makepath(objfn, f->fid);
-			psync_utimes(objfn, f->tim, 0);
-		}
-		if (objfn[0] == '\0')
-			objns_makepath(objfn, f->fid);
-		psync_chmod(objfn, f->mode, 0);
-		close(f->fd);
-		PSCFREE(f);
+	psynclog_diag("close fd=%d", f->fd);
+	dfd = AT_FDCWD;
+	fn = f->path;
+	if (fn == NULL) {
+		dfd = objns_lookup(f->fid, name);
+		fn = name;
+	}
+	fd = f->fd;
+	if (fd == -1) {
+		/* closed for the budget; attributes need one */
+		fd = openat(dfd, fn, O_RDONLY);
+		if (fd == -1)
+			psynclog_warn("open %s", fn);
 	} else
+		psc_atomic32_dec(&fcache_nfds);
+	if (fd != -1) {
+		if (opts.times)
+			psync_futimes(fd, fn, f->tim);
+		/* before the modes may take away write permission */
+		cksum_cache_put(f, fd);
+		psync_fchmod(fd, fn, f->mode);
+		close(fd);
+	}
+	if (f->basefd != -1) {
+		if (opts.checksum_cache)
+			cksum_cache_drop(f->basefd);
+		close(f->basefd);
+		psc_atomic32_dec(&fcache_nfds);
+	}
+	if (f->basefn) {
+		snprintf(name, sizeof(name), "%016"PRIx64".base", f->fid);
+		unlinkat(objns_rootfd, name, 0);
+		PSCFREE(f->basefn);
+	}
+	PSCFREE(f->ck_leaves);
+	PSCFREE(f->ck_new);
+	PSCFREE(f->ck_newok);
+	PSCFREE(f->path);
+	pthread_mutex_destroy(&f->cb_mutex);
+	PSCFREE(f);
+	psc_atomic32_dec(&fin_pending);
+}
+
+void
+finthr_main(struct psc_thread *thr)
+{
+	struct file *f;
+
+	while (pscthr_run(thr)) {
+		f = lc_getwait(&finq);
+		if (f == NULL)
+			break;
+		fcache_finalize(f);
+	}
+}
+
+void
+fcache_close(struct file *f)
+{
+	struct fcache_stripe *s;
+	struct file **fp;
+
+	s = fcache_getstripe(fcache_hash(f->fid));
+	spinlock(&s->fs_lock);
+	spinlock(&f->lock);
+	if (--f->refcnt == 0 && (f->flags & (FF_SAWLAST | FF_LINKED)) ==
+	    (FF_SAWLAST | FF_LINKED) && f->nchunks == f->nchunks_seen) {
+		for (fp = &s->fs_bkts[fcache_hash(f->fid) &
+		    (s->fs_nbkts - 1)]; *fp != f; fp = &(*fp)->next)
+			;
+		*fp = f->next;
+		s->fs_nents--;
 		freelock(&f->lock);
+		freelock(&s->fs_lock);
 
-	psc_hashbkt_put(&fcache, b);
+		/* out of sight; the rest is not on our critical path */
+		psc_atomic32_inc(&fin_pending);
+		lc_add(&finq, f);
+		return;
+	}
+	if (f->refcnt == 0 && f->fd != -1 && (f->flags & FF_ANON) == 0) {
+		spinlock(&fcache_idlelock);
+		psclist_add_tail(&f->lentry, &fcache_idle);
+		freelock(&fcache_idlelock);
+		f->flags |= FF_IDLE;
+	}
+	freelock(&f->lock);
+	freelock(&s->fs_lock);
 }
 
 void
 fcache_init(void)
 {
+	struct rlimit rl;
+	rlim_t rsv;
+	int i;
+
+	for (i = 0; i < FCACHE_NSTRIPES; i++) {
+		INIT_SPINLOCK(&fcache[i].fs_lock);
+		fcache[i].fs_nbkts = FCACHE_MINBKTS;
+		fcache[i].fs_bkts = PSCALLOC(FCACHE_MINBKTS *
+		    sizeof(*fcache[i].fs_bkts));
+	}
+
 	/*
-	 * This hash table needs to dynamically resize.  The worst
-	 * situation would be transferring many small files (~4KiB) over
-	 * a 100Gbps pipe, which would require ~3 million open files and
-	 * ~10 million buckets.
+	 * Transferring many small files over a fast link keeps a lot
+	 * of files open at once, so take all the descriptors we may.
 	 */
-	psc_hashtbl_init(&fcache, 0, struct file, fid, hentry, 191,
-	    NULL, "fcache");
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		psync_fatal("getrlimit");
+	if (rl.rlim_cur < rl.rlim_max) {
+		rlim_t cur = rl.rlim_cur;
+
+		rl.rlim_cur = MIN(rl.rlim_max, FCACHE_MAXFDS);
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+			psynclog_warn("setrlimit NOFILE %"PRIu64,
+			    (uint64_t)rl.rlim_cur);
+			rl.rlim_cur = cur;
+		}
+	}
+	rl.rlim_cur = MIN(rl.rlim_cur, FCACHE_MAXFDS);
+
+	/* leave room for streams, directories, and the like */
+	rsv = MAX(rl.rlim_cur / 8, FCACHE_RSVFDS);
+	fcache_maxfds = rl.rlim_cur > rsv + FCACHE_RSVFDS ?
+	    rl.rlim_cur - rsv : FCACHE_RSVFDS;
+	psynclog_diag("fcache descriptor budget %d", fcache_maxfds);
+
+	lc_reginit(&finq, struct file, lentry, "finq");
+	for (i = 0; i < NFINTHRS; i++)
+		pscthr_setready(pscthr_init(THRT_FIN, finthr_main, NULL,
+		    0, "finthr%d", i));
 }
 
 int
@@ -210,19 +682,566 @@ objns_rm_cb(FTSENT *f, __unusedx void *arg)
 	return (0);
 }
 
+/*
+ * Asynchronous writes of received file data.  Chunks are written by a
+ * pool of threads, or through io_uring where available, so a stall in
+ * the file system does not stop the stream they came in on.  The
+ * chunk is accounted to its file only once written.
+ */
 void
-fcache_destroy(void)
+aio_done(struct wrbuf *wb, ssize_t rc)
+{
+	struct file *f = wb->wb_f;
+
+	if (rc >= 0 && (size_t)rc < wb->wb_len) {
+		/* short write; finish up synchronously */
+		ssize_t rv;
+
+		rv = io_pwrite(f->fd, wb->wb_data + rc, wb->wb_len - rc,
+		    wb->wb_off + rc);
+		rc = rv == -1 ? -1 : rc + rv;
+	}
+	if (rc != (ssize_t)wb->wb_len)
+		psynclog_error("write off=%"PRId64" len=%zd rc=%zd",
+		    wb->wb_off, wb->wb_len, rc);
+	else if (aio_usering)
+		io_countwrite(rc);
+
+	spinlock(&f->lock);
+	f->nchunks_seen += wb->wb_nchunks;
+	if (wb->wb_last)
+		f->flags |= FF_SAWLAST;
+	freelock(&f->lock);
+	fcache_close(f);
+
+	wb->wb_f = NULL;
+	wb->wb_nchunks = 0;
+	psc_pool_return(wrbuf_pool, wb);
+	psc_atomic32_dec(&aio_inflight);
+}
+
+void
+aiothr_main(struct psc_thread *thr)
+{
+	struct wrbuf *wb;
+	ssize_t rc;
+
+	while (pscthr_run(thr)) {
+		wb = lc_getwait(&aioq);
+		if (wb == NULL)
+			break;
+		rc = io_pwrite(wb->wb_f->fd, wb->wb_data, wb->wb_len,
+		    wb->wb_off);
+		aio_done(wb, rc == -1 ? -errno : rc);
+	}
+}
+
+#ifdef HAVE_LIBURING
+void
+aioringthr_main(struct psc_thread *thr)
+{
+	struct io_uring_cqe *cqe;
+	struct wrbuf *wb;
+	int rc;
+
+	while (pscthr_run(thr)) {
+		rc = io_uring_wait_cqe(&aio_ring, &cqe);
+		if (rc == -EINTR)
+			continue;
+		if (rc)
+			psync_fatalx("io_uring_wait_cqe: %s", strerror(-rc));
+		wb = io_uring_cqe_get_data(cqe);
+		rc = cqe->res;
+		io_uring_cqe_seen(&aio_ring, cqe);
+		aio_done(wb, rc);
+	}
+}
+#endif
+
+void
+aio_init(void)
+{
+	int i;
+
+	psc_poolmaster_init(&wrbuf_poolmaster, struct wrbuf, wb_lentry,
+	    PPMF_AUTO, opts.async_writes, opts.async_writes,
+	    opts.async_writes, NULL, NULL, NULL, "wrbuf");
+	wrbuf_pool = psc_poolmaster_getmgr(&wrbuf_poolmaster);
+
+#ifdef HAVE_LIBURING
+	/*
+	 * Chunk buffers vary in size with the sender's block size and
+	 * are traded with the streams, so they are not registered with
+	 * the ring.
+	 */
+	if (io_uring_queue_init(opts.async_writes, &aio_ring, 0) == 0) {
+		aio_usering = 1;
+		pscthr_setready(pscthr_init(THRT_AIO, aioringthr_main,
+		    NULL, 0, "aioringthr"));
+		return;
+	}
+	psynclog_diag("io_uring unavailable, using threads");
+#endif
+
+	lc_reginit(&aioq, struct wrbuf, wb_lentry, "aioq");
+	for (i = 0; i < MIN(opts.async_writes, MAX_AIOTHRS); i++)
+		pscthr_setready(pscthr_init(THRT_AIO, aiothr_main, NULL,
+		    0, "aiothr%d", i));
+}
+
+/*
+ * Get a buffer for a chunk.  This blocks while the maximum number of
+ * writes is in flight so the receiver cannot run away from the disk.
+ */
+struct wrbuf *
+aio_getbuf(void)
+{
+	return (psc_pool_get(wrbuf_pool));
+}
+
+/*
+ * Queue @len bytes at @wb->wb_data to be written to @f at @off.  The
+ * write holds a reference to @f until it completes.  Unless set by the
+ * caller, the write accounts for one chunk of the file.
+ */
+void
+aio_write(struct wrbuf *wb, struct file *f, off_t off, size_t len,
+    int last)
+{
+	if (wb->wb_nchunks == 0)
+		wb->wb_nchunks = 1;
+
+	spinlock(&f->lock);
+	f->refcnt++;
+	freelock(&f->lock);
+
+	INIT_LISTENTRY(&wb->wb_lentry);
+	wb->wb_f = f;
+	wb->wb_off = off;
+	wb->wb_len = len;
+	wb->wb_last = last;
+	psc_atomic32_inc(&aio_inflight);
+
+#ifdef HAVE_LIBURING
+	if (aio_usering) {
+		struct io_uring_sqe *sqe;
+
+		pthread_mutex_lock(&aio_ringlock);
+		while ((sqe = io_uring_get_sqe(&aio_ring)) == NULL)
+			io_uring_submit(&aio_ring);
+		io_uring_prep_write(sqe, f->fd, wb->wb_data, len, off);
+		io_uring_sqe_set_data(sqe, wb);
+		io_uring_submit(&aio_ring);
+		pthread_mutex_unlock(&aio_ringlock);
+		return;
+	}
+#endif
+	lc_add(&aioq, wb);
+}
+
+void
+aio_drain(void)
+{
+	while (psc_atomic32_read(&aio_inflight))
+		usleep(1000);
+}
+
+void
+io_countwrite(size_t len)
+{
+	psc_atomic64_inc(&io_nwrites);
+	psc_atomic64_add(&io_nwbytes, len);
+}
+
+/*
+ * pwrite(2) of received file data, counted for --stats.
+ */
+ssize_t
+io_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t rc;
+
+	rc = pwrite(fd, buf, len, off);
+	if (rc > 0)
+		io_countwrite(rc);
+	return (rc);
+}
+
+/*
+ * Overwrite a range of a received file with zeros where no hole can be
+ * punched.  Only data already in the file has to go, so nothing is
+ * written past its end.
+ */
+void
+io_zero(struct file *f, off_t off, off_t len)
+{
+	static const char zeros[64 * 1024];
+	struct stat stb;
+	ssize_t rc;
+	size_t n;
+
+	if (fstat(f->fd, &stb) == -1) {
+		psynclog_warn("stat fd=%d", f->fd);
+		return;
+	}
+	for (len = MIN(len, stb.st_size - off); len > 0;
+	    off += rc, len -= rc) {
+		n = MIN(len, (off_t)sizeof(zeros));
+		rc = io_pwrite(f->fd, zeros, n, off);
+		if (rc <= 0) {
+			psynclog_error("write off=%"PRId64" len=%zu", off,
+			    n);
+			return;
+		}
+	}
+}
+
+/*
+ * Leave a range of a received file as a hole.  Any data already there
+ * (with --partial or --preallocate) is punched out, or zeroed over
+ * with --partial when the file system cannot punch, and a hole ending
+ * the file sets its size as no write would.
+ */
+void
+io_hole(struct file *f, off_t off, off_t len, int last)
+{
+	int punched = 0;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	static psc_atomic32_t notsup = PSC_ATOMIC32_INIT(0);
+
+	if (!psc_atomic32_read(&notsup)) {
+		if (fallocate(f->fd, FALLOC_FL_PUNCH_HOLE |
+		    FALLOC_FL_KEEP_SIZE, off, len) == 0)
+			punched = 1;
+		else if (errno == EOPNOTSUPP || errno == ENOSYS)
+			psc_atomic32_set(&notsup, 1);
+		else
+			psynclog_warn("punch hole off=%"PRId64" "
+			    "len=%"PRId64, off, len);
+	}
+#endif
+	/* preallocated space reads back as zeros already */
+	if (!punched && opts.partial)
+		io_zero(f, off, len);
+	if (last && ftruncate(f->fd, off + len) == -1)
+		psynclog_warn("truncate fd=%d", f->fd);
+
+	spinlock(&f->lock);
+	f->nchunks_seen++;
+	if (last)
+		f->flags |= FF_SAWLAST;
+	freelock(&f->lock);
+}
+
+/*
+ * Fill a range of a file from its --delta basis, in the kernel where
+ * possible.  Failures are logged and only cost this file its data.
+ */
+void
+io_copy(struct file *f, off_t off, off_t srcoff, size_t len)
 {
-	struct psc_hashbkt *b;
-	struct file *f, *fn;
+	static psc_atomic32_t notsup = PSC_ATOMIC32_INIT(0);
+	char buf[64 * 1024];
+	size_t resid = len;
+	ssize_t rc, n;
 
-	PSC_HASHTBL_FOREACH_BUCKET(b, &fcache)
-		PSC_HASHBKT_FOREACH_ENTRY_SAFE(&fcache, f, fn, b) {
-			close(f->fd);
-			psc_hashbkt_del_item(&fcache, b, f);
-			PSCFREE(f);
+	if (f->basefd == -1) {
+		psynclog_errorx("copy from missing delta basis "
+		    "fid=%#"PRIx64, f->fid);
+		resid = 0;
+	}
+
+#ifdef SYS_copy_file_range
+	while (resid && !psc_atomic32_read(&notsup)) {
+		off_t in = srcoff, out = off;
+
+		rc = syscall(SYS_copy_file_range, f->basefd, &in, f->fd,
+		    &out, resid, 0);
+		if (rc == -1 && (errno == ENOSYS || errno == EXDEV ||
+		    errno == EINVAL || errno == EOPNOTSUPP)) {
+			psc_atomic32_set(&notsup, 1);
+			break;
+		}
+		if (rc == -1) {
+			psynclog_error("copy_file_range off=%"PRId64, off);
+			resid = 0;
+			break;
+		}
+		if (rc == 0)
+			break;
+		io_countwrite(rc);
+		srcoff += rc;
+		off += rc;
+		resid -= rc;
+	}
+#endif
+	while (resid) {
+		n = MIN(resid, sizeof(buf));
+		rc = pread(f->basefd, buf, n, srcoff);
+		if (rc <= 0) {
+			psynclog_error("read delta basis off=%"PRId64, srcoff);
+			break;
+		}
+		if (io_pwrite(f->fd, buf, rc, off) != rc)
+			psynclog_error("write off=%"PRId64" len=%zd", off, rc);
+		srcoff += rc;
+		off += rc;
+		resid -= rc;
+	}
+
+	spinlock(&f->lock);
+	f->nchunks_seen++;
+	freelock(&f->lock);
+}
+
+/*
+ * Write coalescing.  Chunks of a file arrive on all streams and would
+ * be written as many small writes at scattered offsets, which parallel
+ * file systems punish with lock contention.  Instead, runs of adjacent
+ * chunks are gathered per file and written once they fill a window
+ * aligned to the file's preferred I/O size, when a gap shows up, when
+ * the last chunk arrives, or after a timeout.  Chunks held back are
+ * only accounted to the file once written.
+ */
+uint64_t
+coalesce_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Write out what @f holds; cb_mutex must be held.  Returns nonzero if
+ * the caller must drop the reference that held the file open, which
+ * may only be done once cb_mutex is released.
+ */
+int
+coalesce_flush(struct file *f)
+{
+	struct wrbuf *wb;
+	ssize_t rc;
+
+	if (f->cb_len == 0)
+		return (0);
+
+	if (opts.async_writes) {
+		wb = aio_getbuf();
+		PSCFREE(wb->wb_buf);
+		wb->wb_buf = f->cb_buf;
+		wb->wb_bufsz = f->cb_winsz;
+		wb->wb_data = f->cb_buf;
+		wb->wb_nchunks = f->cb_nchunks;
+		f->cb_buf = NULL;
+		aio_write(wb, f, f->cb_off, f->cb_len, f->cb_last);
+	} else {
+		rc = io_pwrite(f->fd, f->cb_buf, f->cb_len, f->cb_off);
+		if (rc != (ssize_t)f->cb_len)
+			psynclog_error("write off=%"PRId64" len=%zd "
+			    "rc=%zd", f->cb_off, f->cb_len, rc);
+		PSCFREE(f->cb_buf);
+
+		spinlock(&f->lock);
+		f->nchunks_seen += f->cb_nchunks;
+		if (f->cb_last)
+			f->flags |= FF_SAWLAST;
+		freelock(&f->lock);
+	}
+	psc_atomic64_sub(&coal_mem, f->cb_winsz);
+
+	f->cb_len = 0;
+	f->cb_nchunks = 0;
+	f->cb_last = 0;
+
+	spinlock(&coal_lock);
+	psc_dynarray_removeitem(&coal_files, f);
+	freelock(&coal_lock);
+	return (1);
+}
+
+/*
+ * Offer a received chunk to be written as part of a larger write.
+ * Returns zero if the caller is to write it out itself.
+ */
+int
+coalesce_put(struct file *f, const void *data, size_t len, off_t off,
+    int last)
+{
+	struct stat stb;
+	int nheld = 0, rc = 0;
+	size_t n;
+
+	pthread_mutex_lock(&f->cb_mutex);
+	if (f->cb_winsz == 0) {
+		f->cb_winsz = opts.coalesce;
+		if (fstat(f->fd, &stb) == 0 && stb.st_blksize > 0)
+			f->cb_winsz = roundup(f->cb_winsz,
+			    (size_t)stb.st_blksize);
+	}
+
+	/* a gap: what is held cannot be extended */
+	if (f->cb_len && off != f->cb_off + (off_t)f->cb_len)
+		nheld += coalesce_flush(f);
+
+	if (f->cb_nomore || len >= f->cb_winsz)
+		goto out;
+
+	while (len) {
+		if (f->cb_len == 0) {
+			psc_atomic64_add(&coal_mem, f->cb_winsz);
+			if ((uint64_t)psc_atomic64_read(&coal_mem) >
+			    opts.coalesce_mem) {
+				psc_atomic64_sub(&coal_mem, f->cb_winsz);
+				break;
+			}
+			f->cb_buf = PSCALLOC(f->cb_winsz);
+			f->cb_off = off;
+			f->cb_stamp = coalesce_now();
+
+			/* hold the file open while holding its data */
+			spinlock(&f->lock);
+			f->refcnt++;
+			freelock(&f->lock);
+
+			spinlock(&coal_lock);
+			push(&coal_files, f);
+			freelock(&coal_lock);
 		}
 
+		/* fill up to the next window boundary */
+		n = roundup(f->cb_off + 1, f->cb_winsz) - f->cb_off -
+		    f->cb_len;
+		n = MIN(n, len);
+		memcpy(f->cb_buf + f->cb_len, data, n);
+		f->cb_len += n;
+		data = (const char *)data + n;
+		off += n;
+		len -= n;
+		rc = 1;
+		if (len == 0) {
+			f->cb_nchunks++;
+			f->cb_last = last;
+		}
+		if (f->cb_off + f->cb_len == roundup(f->cb_off + 1,
+		    f->cb_winsz) || f->cb_last)
+			nheld += coalesce_flush(f);
+	}
+	if (rc && len) {
+		/*
+		 * Out of memory budget midway through the chunk after
+		 * its head was written out with the window it filled;
+		 * write the rest now.
+		 */
+		if (io_pwrite(f->fd, data, len, off) != (ssize_t)len)
+			psynclog_error("write off=%"PRId64" len=%zd",
+			    (int64_t)off, len);
+		spinlock(&f->lock);
+		f->nchunks_seen++;
+		if (last)
+			f->flags |= FF_SAWLAST;
+		freelock(&f->lock);
+	}
+
+ out:
+	if (last)
+		f->cb_nomore = 1;
+	pthread_mutex_unlock(&f->cb_mutex);
+	while (nheld--)
+		fcache_close(f);
+	return (rc);
+}
+
+/*
+ * Write out the data files have held for at least @age milliseconds.
+ */
+void
+coalesce_flushall(uint64_t age)
+{
+	struct psc_dynarray da = DYNARRAY_INIT;
+	struct file *f;
+	uint64_t now;
+	int i, n;
+
+	now = coalesce_now();
+	spinlock(&coal_lock);
+	DYNARRAY_FOREACH(f, i, &coal_files) {
+		spinlock(&f->lock);
+		f->refcnt++;
+		freelock(&f->lock);
+		push(&da, f);
+	}
+	freelock(&coal_lock);
+
+	DYNARRAY_FOREACH(f, i, &da) {
+		n = 0;
+		pthread_mutex_lock(&f->cb_mutex);
+		if (f->cb_len && now - f->cb_stamp >= age)
+			n = coalesce_flush(f);
+		pthread_mutex_unlock(&f->cb_mutex);
+		if (n)
+			fcache_close(f);
+		fcache_close(f);
+	}
+	psc_dynarray_free(&da);
+}
+
+void
+coalthr_main(struct psc_thread *thr)
+{
+	while (pscthr_run(thr)) {
+		usleep(COALESCE_TIMEOUT_MS * 1000 / 2);
+		coalesce_flushall(COALESCE_TIMEOUT_MS);
+	}
+}
+
+void
+coalesce_init(void)
+{
+	pscthr_setready(pscthr_init(THRT_COAL, coalthr_main, NULL, 0,
+	    "coalthr"));
+}
+
+void
+fcache_destroy(void)
+{
+	struct fcache_stripe *s;
+	struct file *f, *next;
+	size_t i;
+	int j;
+
+	if (opts.coalesce)
+		coalesce_flushall(0);
+	aio_drain();
+	while (psc_atomic32_read(&fin_pending))
+		usleep(1000);
+
+	for (j = 0; j < objns_ndirs; j++)
+		close(objns_dirfds[j]);
+	if (objns_rootfd != -1)
+		close(objns_rootfd);
+
+	for (j = 0; j < FCACHE_NSTRIPES; j++) {
+		s = &fcache[j];
+		for (i = 0; i < s->fs_nbkts; i++)
+			for (f = s->fs_bkts[i]; f; f = next) {
+				next = f->next;
+				if (f->fd != -1)
+					close(f->fd);
+				if (f->basefd != -1)
+					close(f->basefd);
+				PSCFREE(f->ck_leaves);
+				PSCFREE(f->ck_new);
+				PSCFREE(f->ck_newok);
+				PSCFREE(f->basefn);
+				PSCFREE(f->path);
+				PSCFREE(f);
+			}
+		PSCFREE(s->fs_bkts);
+		s->fs_nbkts = s->fs_nents = 0;
+	}
+
 	if (objns_path[0]) {
 		/* unlink object namespace */
 		pfl_filewalk(objns_path, PFL_FILEWALKF_RECURSIVE |
@@ -55,6 +55,7 @@ struct option longopts[] = {
 	{ "bwlimit",		REQARG,	NULL,			OPT_BWLIMIT },
 	{ "cache",		NO_ARG,	&opts.cache,		1 },
 	{ "checksum",		NO_ARG,	NULL,			'c' },
+	{ "checksum-cache",	NO_ARG,	&opts.checksum_cache,	1 },
 	{ "chmod",		REQARG,	NULL,			OPT_CHMOD },
 	{ "compare-dest",	REQARG,	NULL,			OPT_COMPARE_DEST },
 	{ "compress",		NO_ARG,	NULL,			'z' },
@@ -145,8 +146,23 @@ struct option longopts[] = {
 	{ "write-batch",	REQARG,	NULL,			OPT_WRITE_BATCH },
 
 	/* psync specific options */
+	{ "async-writes",	REQARG,	NULL,			OPT_ASYNC_WRITES },
+	{ "coalesce",		REQARG,	NULL,			OPT_COALESCE },
+	{ "coalesce-mem",	REQARG,	NULL,			OPT_COALESCE_MEM },
+	{ "delta",		NO_ARG,	&opts.delta,		1 },
+	{ "digest",		REQARG,	NULL,			OPT_DIGEST },
 	{ "dstdir",		REQARG,	NULL,			OPT_DSTDIR },
+	{ "inline-size",	REQARG,	NULL,			OPT_INLINE_SIZE },
+	{ "objns-depth",	REQARG,	NULL,			OPT_OBJNS_DEPTH },
+	{ "preallocate",	NO_ARG,	&opts.preallocate,	1 },
+	{ "read-ahead",		REQARG,	NULL,			OPT_READ_AHEAD },
+	{ "read-ahead-file",	REQARG,	NULL,			OPT_READ_AHEAD_FILE },
+	{ "splice",		NO_ARG,	&opts.splice,		1 },
 	{ "streams",		REQARG,	&opts.streams,		'N' },
+	{ "tmpfile",		NO_ARG,	&opts.tmpfile,		1 },
+	{ "walkers",		REQARG,	NULL,			OPT_WALKERS },
+	{ "zero-check",		REQARG,	NULL,			OPT_ZERO_CHECK },
+	{ "zero-copy",		NO_ARG,	&opts.zerocopy,		1 },
 
 	{ NULL,			0,	NULL,			0 }
 };
@@ -260,6 +276,13 @@ parseopts(int argc, char **argv)
 	    "-oKbdInteractiveAuthentication=no "
 	    "-oNumberOfPasswordPrompts=1";
 	opts.streams = getnstreams(getnprocessors());
+	opts.inline_size = DEF_INLINE_SIZE;
+	opts.read_ahead_file = DEF_READ_AHEAD_FILE;
+	opts.walkers = DEF_WALKERS;
+	opts.objns_depth = DEF_OBJNS_DEPTH;
+	opts.coalesce_mem = DEF_COALESCE_MEM;
+	opts.digest = -1;
+	opts.zero_check = -1;
 
 	while ((c = getopt_long(argc, argv,
 	    "0468aB:bCcDdEEe:f:gHhIiKkLlmN:nOoPpqRrST:tuVvWxyz", longopts,
@@ -391,7 +414,61 @@ parseopts(int argc, char **argv)
 		case OPT_WRITE_BATCH:	opts.write_batch = optarg;	break;
 
 		/* psync specific options */
+		case OPT_ASYNC_WRITES:
+			if (!parsenum(&opts.async_writes, optarg, 0, INT_MAX))
+				err(1, "--async-writes=%s", optarg);
+			break;
+		case OPT_COALESCE:
+			if (!parsesize(&opts.coalesce, optarg, 1))
+				err(1, "--coalesce=%s", optarg);
+			break;
+		case OPT_COALESCE_MEM:
+			if (!parsesize(&opts.coalesce_mem, optarg, 1))
+				err(1, "--coalesce-mem=%s", optarg);
+			break;
+		case OPT_DIGEST:
+			if (strcmp(optarg, "list") == 0) {
+				digest_list(stdout);
+				exit(0);
+			}
+			opts.digest = digest_byname(optarg);
+			if (opts.digest == -1)
+				errx(1, "--digest=%s: unknown algorithm",
+				    optarg);
+			break;
 		case OPT_DSTDIR:	opts.dstdir = optarg;		break;
+		case OPT_INLINE_SIZE:
+			if (!parsesize(&opts.inline_size, optarg, 1))
+				err(1, "--inline-size=%s", optarg);
+			break;
+		case OPT_OBJNS_DEPTH:
+			if (!parsenum(&opts.objns_depth, optarg, 1,
+			    MAX_OBJNS_DEPTH))
+				err(1, "--objns-depth=%s", optarg);
+			break;
+		case OPT_READ_AHEAD:
+			if (!parsenum(&opts.read_ahead, optarg, 0, INT_MAX))
+				err(1, "--read-ahead=%s", optarg);
+			break;
+		case OPT_READ_AHEAD_FILE:
+			if (!parsenum(&opts.read_ahead_file, optarg, 1,
+			    INT_MAX))
+				err(1, "--read-ahead-file=%s", optarg);
+			break;
+		case OPT_WALKERS:
+			if (!parsenum(&opts.walkers, optarg, 1, MAX_WALKERS))
+				err(1, "--walkers=%s", optarg);
+			break;
+		case OPT_ZERO_CHECK:
+			if (strcmp(optarg, "list") == 0) {
+				zero_list(stdout);
+				exit(0);
+			}
+			opts.zero_check = zero_byname(optarg);
+			if (opts.zero_check == -1)
+				errx(1, "--zero-check=%s: unknown or "
+				    "unsupported", optarg);
+			break;
 		case OPT_PUPPET:
 			if (!parsenum(&opts.puppet, optarg, 0, 1000000))
 				err(1, "--PUPPET=%s", optarg);
@@ -404,4 +481,19 @@ parseopts(int argc, char **argv)
 			usage();
 		}
 	}
+
+	/* --partial resumes from the file already in place */
+	if (opts.partial) {
+		opts.tmpfile = 0;
+		/* and that file cannot serve as its own basis */
+		opts.delta = 0;
+		opts.checksum = 0;
+	}
+
+	/*
+	 * Further names of a file are linked from the first, which an
+	 * anonymous --tmpfile file no longer has once it is complete.
+	 */
+	if (opts.links)
+		opts.tmpfile = 0;
 }
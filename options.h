@@ -60,9 +60,19 @@ enum {
 	OPT_WRITE_BATCH,
 
 	/* psync specific options */
+	OPT_ASYNC_WRITES,
+	OPT_COALESCE,
+	OPT_COALESCE_MEM,
+	OPT_DIGEST,
 	OPT_DSTDIR,
 	OPT_HEAD,
-	OPT_PUPPET
+	OPT_INLINE_SIZE,
+	OPT_OBJNS_DEPTH,
+	OPT_PUPPET,
+	OPT_READ_AHEAD,
+	OPT_READ_AHEAD_FILE,
+	OPT_WALKERS,
+	OPT_ZERO_CHECK
 };
 
 struct options {
@@ -95,6 +105,7 @@ struct options {
 	uint64_t		 bwlimit;
 	int			 cache;
 	int			 checksum;
+	int			 checksum_cache;	/* xattr or .psync-cksum */
 	int			 compress;
 	int			 compress_level;
 	int			 copy_dirlinks;
@@ -166,6 +177,21 @@ struct options {
 	int			 streams;
 	int			 head;
 	const char		*dstdir;
+	uint64_t		 inline_size;	/* max size to send with name */
+	int			 zerocopy;
+	int			 splice;		/* zero-copy receive */
+	int			 async_writes;		/* max writes in flight */
+	uint64_t		 coalesce;		/* per file write size */
+	uint64_t		 coalesce_mem;
+	int			 read_ahead;	/* max buffers, 0 to mmap */
+	int			 read_ahead_file;
+	int			 walkers;		/* tree walk threads */
+	int			 objns_depth;
+	int			 tmpfile;		/* anonymous until named */
+	int			 preallocate;
+	int			 delta;		/* send changes to existing files */
+	int			 digest;	/* DIGEST_*, -1 to negotiate */
+	int			 zero_check;	/* implementation, -1 for best */
 };
 
 void parseopts(int, char **);
@@ -26,12 +26,14 @@
  */
 
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/sysctl.h>
 #include <sys/syscall.h>
 #include <sys/un.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -71,21 +73,70 @@
 #define MODE_GET	0
 #define MODE_PUT	1
 
+/*
+ * Work items are kept small as a large tree queues one for every file
+ * up front: type-specific fields are overlaid and names are interned
+ * into the arena of the walk that produced them.
+ */
 struct work {
 	struct psc_listentry	  wk_lentry;
-	char			  wk_fn[PATH_MAX];
-	char			  wk_basefn[NAME_MAX + 1];
-	struct filehandle	 *wk_fh;
-	char			 *wk_buf;
-	char			  wk_host[PFL_HOSTNAME_MAX];
 	int			  wk_type;
 	int			  wk_rflags;
-	size_t			  wk_len;
-	struct stat		  wk_stb;
-	uint64_t		  wk_xid;
+	int			  wk_flags;
 	uint64_t		  wk_fid;
-	uint64_t		  wk_nchunks;
-	off_t			  wk_off;
+	const char		 *wk_fn;	/* in strarena */
+	union {
+		struct {
+			struct filehandle	*fh;
+			struct buf		*rabuf;	/* read-ahead data */
+			size_t			 len;	/* chunk size for ranges */
+			off_t			 off;
+			off_t			 end;	/* end of range */
+			int			 level;	/* of GETCKSUM tree */
+		} pd;
+		struct {
+			char			*buf;	/* link target or data */
+			size_t			 buflen;
+			uint64_t		 nchunks;
+			struct rpc_sub_stat	 pstb;
+		} pn;
+		struct {
+			const char		*basefn; /* in strarena */
+			uint64_t		 xid;
+		} gf;
+		struct {
+			uint64_t		 nchunks;
+			off_t			 size;
+		} pe;
+	} wk_u;
+};
+
+#define wk_fh		wk_u.pd.fh
+#define wk_rabuf	wk_u.pd.rabuf
+#define wk_len		wk_u.pd.len
+#define wk_off		wk_u.pd.off
+#define wk_end		wk_u.pd.end
+#define wk_level	wk_u.pd.level
+#define wk_buf		wk_u.pn.buf
+#define wk_buflen	wk_u.pn.buflen
+#define wk_nchunks	wk_u.pn.nchunks
+#define wk_pstb		wk_u.pn.pstb
+#define wk_basefn	wk_u.gf.basefn
+#define wk_xid		wk_u.gf.xid
+#define wk_eofchunks	wk_u.pe.nchunks
+#define wk_eofsize	wk_u.pe.size
+
+#define WKF_RANGE		(1 << 0)	/* chunks are carved on demand */
+#define WKF_LASTRANGE		(1 << 1)	/* range runs to end of file */
+#define WKF_HOLE		(1 << 2)	/* PUTDATA of a range of zeros */
+#define WKF_DELTA		(1 << 3)	/* range to scan for --delta */
+#define WKF_COPY		(1 << 4)	/* range unchanged, copied by peer */
+#define WKF_LOCAL		(1 << 5)	/* GETCKSUM of our own side */
+#define WKF_KEEP		(1 << 6)	/* PUTEOF of a file found unchanged */
+
+struct extent {
+	off_t			  x_off;
+	off_t			  x_end;
 };
 
 struct ino_entry {
@@ -93,14 +144,6 @@ struct ino_entry {
 	struct psc_hashentry	  i_hentry;
 };
 
-enum {
-	THRT_DISP,
-	THRT_MAIN,
-	THRT_RCV,
-	THRT_OPSTIMER,
-	THRT_WKR
-};
-
 const char		*progname;
 
 struct psc_poolmaster	 buf_poolmaster;
@@ -114,6 +157,10 @@ struct psc_listcache	 workq;
 struct psc_poolmaster	 work_poolmaster;
 struct psc_poolmgr	*work_pool;
 
+struct psc_listcache	 readq;			/* chunks awaiting read-ahead */
+struct psc_poolmaster	 rabuf_poolmaster;
+struct psc_poolmgr	*rabuf_pool;
+
 struct psc_hashtbl	 ino_hashtbl;
 
 struct pfl_opstat	*iostats;
@@ -125,15 +172,19 @@ mode_t			 psync_umask;
 
 struct psc_dynarray	 wkrthrs = DYNARRAY_INIT;
 struct psc_dynarray	 rcvthrs = DYNARRAY_INIT;
+struct psc_dynarray	 rdthrs = DYNARRAY_INIT;
 
 psc_spinlock_t		 wkrthrs_lock = SPINLOCK_INIT;
 psc_spinlock_t		 rcvthrs_lock = SPINLOCK_INIT;
+psc_spinlock_t		 rdthrs_lock = SPINLOCK_INIT;
 
 psc_atomic64_t		 nbytes_total = PSC_ATOMIC64_INIT(0);
 psc_atomic64_t		 nbytes_xfer = PSC_ATOMIC64_INIT(0);
 
 psc_atomic64_t		 psync_fid = PSC_ATOMIC64_INIT(0);
 
+psc_atomic32_t		 nranges = PSC_ATOMIC32_INIT(0);
+
 struct psc_compl	 psync_ready = PSC_COMPL_INIT;
 
 unsigned char		 psync_authbuf[AUTH_LEN];
@@ -170,6 +221,7 @@ filehandle_new(uint64_t fid, size_t len)
 	memset(fh, 0, sizeof(*fh));
 	INIT_SPINLOCK(&fh->lock);
 	INIT_LISTENTRY(&fh->lentry);
+	psc_waitq_init(&fh->wq, "fh");
 	fh->refcnt++;
 	fh->fid = fid;
 	fh->len = len;
@@ -178,12 +230,695 @@ filehandle_new(uint64_t fid, size_t len)
 	return (fh);
 }
 
+struct work *
+work_getitem(int type)
+{
+	struct work *wk;
+
+	wk = psc_pool_get(work_pool);
+	memset(wk, 0, sizeof(*wk));
+	INIT_LISTENTRY(&wk->wk_lentry);
+	wk->wk_type = type;
+	return (wk);
+}
+
+/*
+ * Carve the next chunk off range work item @wk into @c.  Unless it is
+ * the last chunk, the range takes another filehandle reference on
+ * behalf of the chunk and is put back at the head of @lc so other
+ * threads can carve from the same file concurrently.  Otherwise the
+ * range is finished and its reference passes on to the chunk.
+ */
+int
+work_carve(struct psc_listcache *lc, struct work *wk, struct work *c)
+{
+	struct filehandle *fh = wk->wk_fh;
+	int last;
+
+	c->wk_fh = fh;
+	c->wk_fid = wk->wk_fid;
+	c->wk_off = wk->wk_off;
+	c->wk_len = MIN((off_t)wk->wk_len, wk->wk_end - wk->wk_off);
+	c->wk_rflags = 0;
+	c->wk_rabuf = NULL;
+
+	wk->wk_off += c->wk_len;
+	last = wk->wk_off >= wk->wk_end;
+	if (last) {
+		if (wk->wk_flags & WKF_LASTRANGE)
+			c->wk_rflags |= RPC_PUTDATA_F_LAST;
+		psc_atomic32_dec(&nranges);
+	} else {
+		spinlock(&fh->lock);
+		fh->refcnt++;
+		freelock(&fh->lock);
+		lc_addhead(lc, wk);
+	}
+	return (last);
+}
+
+/*
+ * Read-ahead: fill a pooled buffer with the next chunk of a file and
+ * pass it on to the wkrthrs.  In-flight chunks are bounded both per
+ * file and globally (by the size of the buffer pool) so neither the
+ * address space nor the page cache footprint grow with the file size.
+ */
+void
+rdthr_main(struct psc_thread *thr)
+{
+	struct filehandle *fh;
+	struct work *wk, *rwk;
+	struct buf *b;
+	ssize_t rc;
+
+	while (pscthr_run(thr)) {
+		rwk = lc_getwait(&readq);
+		if (rwk == NULL)
+			break;
+
+		/*
+		 * Hold on to the range while waiting for a slot so the
+		 * other readers move on to other files meanwhile.
+		 */
+		fh = rwk->wk_fh;
+		spinlock(&fh->lock);
+		while (fh->ra_inflight >= opts.read_ahead_file) {
+			psc_waitq_wait(&fh->wq, &fh->lock);
+			spinlock(&fh->lock);
+		}
+		fh->ra_inflight++;
+		freelock(&fh->lock);
+
+		wk = work_getitem(OPC_PUTDATA);
+		if (work_carve(&readq, rwk, wk))
+			psc_pool_return(work_pool, rwk);
+
+		b = psc_pool_get(rabuf_pool);
+		if (wk->wk_len > b->len) {
+			b->buf = psc_realloc(b->buf, wk->wk_len, 0);
+			b->len = wk->wk_len;
+		}
+		rc = pread(fh->fd, b->buf, wk->wk_len, wk->wk_off);
+		if (rc == -1)
+			psync_fatal("read off=%"PRId64, wk->wk_off);
+		if ((size_t)rc != wk->wk_len) {
+			/* file shrank; pad so the receiver sees the size */
+			memset((char *)b->buf + rc, 0, wk->wk_len - rc);
+			psynclog_warnx("read: short I/O");
+		}
+		wk->wk_rabuf = b;
+		lc_add(&workq, wk);
+
+		if (exit_from_signal)
+			break;
+	}
+
+	spinlock(&rdthrs_lock);
+	psc_dynarray_removeitem(&rdthrs, thr);
+	freelock(&rdthrs_lock);
+}
+
+void
+rabuf_release(struct work *wk)
+{
+	struct filehandle *fh = wk->wk_fh;
+
+	psc_pool_return(rabuf_pool, wk->wk_rabuf);
+	wk->wk_rabuf = NULL;
+
+	spinlock(&fh->lock);
+	fh->ra_inflight--;
+	psc_waitq_wakeall(&fh->wq);
+	freelock(&fh->lock);
+}
+
+/*
+ * No more work will be queued: let the read-ahead stage drain into
+ * workq before shutting it down.
+ */
+void
+workq_kill(void)
+{
+	/* ranges are put back on their queue until exhausted */
+	while (psc_atomic32_read(&nranges) && !exit_from_signal)
+		usleep(10000);
+
+	if (opts.read_ahead) {
+		lc_kill(&readq);
+		while (psc_dynarray_len(&rdthrs))
+			usleep(10000);
+	}
+	lc_kill(&workq);
+}
+
+void
+putdata_send(struct stream *st, struct work *wk)
+{
+	char *p;
+
+	if (wk->wk_rabuf)
+		p = wk->wk_rabuf->buf;
+	else
+		p = (char *)wk->wk_fh->base + wk->wk_off;
+	if (opts.sparse && zero_check(p, wk->wk_len))
+		/* all zeros; have the receiver leave a hole instead */
+		rpc_send_puthole(st, wk->wk_fid, wk->wk_off, wk->wk_len,
+		    wk->wk_rflags);
+	else
+		/* data already read ahead is sent as is, padding and all */
+		rpc_send_putdata(st, wk->wk_fid, wk->wk_off, p,
+		    wk->wk_len, wk->wk_rflags, opts.zerocopy &&
+		    wk->wk_rabuf == NULL ? wk->wk_fh->fd : -1);
+	psc_atomic64_add(&nbytes_xfer, wk->wk_len);
+	if (wk->wk_rabuf)
+		rabuf_release(wk);
+	filehandle_dropref(wk->wk_fh);
+}
+
+/*
+ * A --delta or --checksum transfer holds a filehandle reference and
+ * counts as a range from the time the name is queued until all of the
+ * file has been queued to be sent.
+ */
+void
+basis_done(struct filehandle *fh)
+{
+	if (fh->delta)
+		delta_free(fh->delta);
+	if (fh->cktree)
+		cktree_free(fh->cktree);
+	fh->delta = NULL;
+	fh->cktree = NULL;
+	psc_atomic32_dec(&nranges);
+	filehandle_dropref(fh);
+}
+
+/*
+ * Queue [@off, @end) of a file to be sent in chunks of @blksz, or with
+ * WKF_COPY, to be copied by the receiver from its basis.
+ */
+void
+basis_queue(struct filehandle *fh, off_t off, off_t end, size_t blksz,
+    int flags)
+{
+	struct work *wk;
+
+	spinlock(&fh->lock);
+	fh->refcnt++;
+	freelock(&fh->lock);
+
+	wk = work_getitem(OPC_PUTDATA);
+	wk->wk_flags |= WKF_RANGE | flags;
+	wk->wk_fh = fh;
+	wk->wk_fid = fh->fid;
+	wk->wk_off = off;
+	wk->wk_end = end;
+	wk->wk_len = blksz;
+	psc_atomic32_inc(&nranges);
+	lc_add(opts.read_ahead && (flags & WKF_COPY) == 0 ? &readq :
+	    &workq, wk);
+}
+
+/*
+ * The number of chunks is only known once a file is compared, so the
+ * receiver is told after all of them are queued.  With WKF_KEEP, none
+ * are sent and the receiver keeps the basis instead.
+ */
+void
+basis_eof(struct filehandle *fh, uint64_t nchunks, int flags)
+{
+	struct work *wk;
+
+	wk = work_getitem(OPC_PUTEOF);
+	wk->wk_flags = flags;
+	wk->wk_fid = fh->fid;
+	wk->wk_eofchunks = nchunks;
+	wk->wk_eofsize = fh->len;
+	lc_add(&workq, wk);
+}
+
+/*
+ * No basis to compare against: send the file in full after all.
+ */
+void
+basis_whole(struct filehandle *fh)
+{
+	size_t blksz;
+
+	blksz = fh->delta ? fh->delta->d_sendsz : fh->cktree->ct_leafsz;
+	basis_eof(fh, howmany(fh->len, blksz), 0);
+	basis_queue(fh, 0, fh->len, blksz, 0);
+	basis_done(fh);
+}
+
+/*
+ * Ask for the signatures of the blocks of the basis in pieces so they
+ * are computed on all streams at once.
+ */
+void
+delta_start(struct filehandle *fh, uint64_t basesize)
+{
+	struct delta *d = fh->delta;
+	struct work *wk;
+	uint32_t i, per;
+
+	delta_setbasis(d, basesize);
+	per = (MAX_BUFSZ - sizeof(struct rpc_getcksum_rep)) /
+	    sizeof(struct rpc_blksig);
+	per = MIN(per, DELTA_REQBLKS);
+	d->d_nreqs = howmany(d->d_nblks, per);
+	for (i = 0; i < d->d_nblks; i += per) {
+		wk = work_getitem(OPC_GETCKSUM_REQ);
+		wk->wk_fh = fh;
+		wk->wk_fid = fh->fid;
+		wk->wk_off = (off_t)i * d->d_blksz;
+		wk->wk_len = MIN((off_t)per * d->d_blksz,
+		    (off_t)basesize - wk->wk_off);
+		lc_add(&workq, wk);
+	}
+}
+
+/*
+ * Take the signatures of a piece of the basis.  Once all are in, the
+ * file is queued to be scanned in segments.
+ */
+void
+delta_addsigs(struct filehandle *fh, struct rpc_getcksum_rep *gcp)
+{
+	struct delta *d = fh->delta;
+	struct work *wk;
+	uint64_t blk;
+	off_t off;
+	int last;
+
+	blk = gcp->off / d->d_blksz;
+	if (gcp->off % d->d_blksz || blk + gcp->nblks > d->d_nblks)
+		psync_fatalx("invalid GETCKSUM_REP range from peer");
+	if (gcp->rc == 0)
+		memcpy(&d->d_sigs[blk], gcp->sigs,
+		    gcp->nblks * sizeof(*gcp->sigs));
+
+	spinlock(&d->d_lock);
+	if (gcp->rc)
+		d->d_failed = 1;
+	last = --d->d_nreqs == 0;
+	freelock(&d->d_lock);
+	if (!last)
+		return;
+
+	if (d->d_failed) {
+		basis_whole(fh);
+		return;
+	}
+
+	delta_index(d);
+	psc_atomic32_set(&d->d_nsegs, howmany(d->d_size, DELTA_SEGSZ));
+	for (off = 0; off < d->d_size; off += DELTA_SEGSZ) {
+		wk = work_getitem(OPC_PUTDATA);
+		wk->wk_flags |= WKF_DELTA;
+		wk->wk_fh = fh;
+		wk->wk_fid = fh->fid;
+		wk->wk_off = off;
+		wk->wk_end = MIN(off + DELTA_SEGSZ, d->d_size);
+		lc_add(&workq, wk);
+	}
+}
+
+/*
+ * Ask for the root of the receiver's digest tree while our side of the
+ * file is hashed.
+ */
+void
+cktree_start(struct filehandle *fh)
+{
+	struct cktree *ct = fh->cktree;
+	struct work *wk;
+
+	ct->ct_nreqs = 1;
+	wk = work_getitem(OPC_GETCKSUM_REQ);
+	wk->wk_fh = fh;
+	wk->wk_fid = fh->fid;
+	wk->wk_off = 0;
+	wk->wk_len = ct->ct_size;
+	wk->wk_level = ct->ct_height;
+	lc_add(&workq, wk);
+
+	wk = work_getitem(OPC_GETCKSUM_REQ);
+	wk->wk_flags |= WKF_LOCAL;
+	wk->wk_fh = fh;
+	wk->wk_fid = fh->fid;
+	lc_add(&workq, wk);
+}
+
+/*
+ * Compare nodes of the receiver's tree with ours.  Equal subtrees are
+ * copied by the receiver from its basis, differing leaves are sent,
+ * and the children of differing inner nodes are asked for next.
+ */
+void
+cktree_addnodes(struct filehandle *fh, struct rpc_getcksum_rep *gcp)
+{
+	struct cktree *ct = fh->cktree;
+	unsigned char mine[ALGLEN];
+	struct rpc_getcksum_rep *cp;
+	uint64_t first, span, i;
+	struct work *wk;
+	off_t off, end;
+	size_t len;
+	int last;
+
+	if (!ct->ct_ready) {
+		len = sizeof(*gcp) + gcp->nblks * sizeof(gcp->sigs[0]);
+		cp = PSCALLOC(len);
+		memcpy(cp, gcp, len);
+
+		spinlock(&ct->ct_lock);
+		if (!ct->ct_ready) {
+			/* only the root gets here before our side */
+			ct->ct_early = cp;
+			freelock(&ct->ct_lock);
+			return;
+		}
+		freelock(&ct->ct_lock);
+		PSCFREE(cp);
+	}
+
+	if (gcp->level > (uint32_t)ct->ct_height)
+		psync_fatalx("invalid GETCKSUM_REP level from peer");
+	for (span = ct->ct_leafsz, i = 0; i < gcp->level; i++)
+		span *= CKTREE_FANOUT;
+	first = gcp->off / span;
+	if (gcp->off % span || first + gcp->nblks >
+	    cksum_nnodes(ct->ct_nleaves, gcp->level))
+		psync_fatalx("invalid GETCKSUM_REP range from peer");
+
+	if (gcp->level == ct->ct_height && gcp->rc == 0 && gcp->nblks &&
+	    psync_peer_features & RPC_READY_F_KEEPBASIS) {
+		cksum_node(ct->ct_leaves, ct->ct_nleaves, gcp->level, 0,
+		    mine);
+		if (memcmp(mine, gcp->sigs[0].strong, ALGLEN) == 0) {
+			/* unchanged: nothing to send or rebuild */
+			psc_atomic64_add(&cksum_nunchanged, ct->ct_size);
+			basis_eof(fh, 0, WKF_KEEP);
+			basis_done(fh);
+			return;
+		}
+	}
+
+	if (gcp->rc) {
+		/* basis turned unreadable; send what was asked about */
+		end = gcp->level == ct->ct_height ? ct->ct_size :
+		    MIN(gcp->off + span * CKTREE_FANOUT, (uint64_t)ct->ct_size);
+		basis_queue(fh, gcp->off, end, ct->ct_leafsz, 0);
+	}
+
+	for (i = 0; i < gcp->nblks; i++) {
+		off = (first + i) * span;
+		end = MIN(off + span, (uint64_t)ct->ct_size);
+		cksum_node(ct->ct_leaves, ct->ct_nleaves, gcp->level,
+		    first + i, mine);
+		if (memcmp(mine, gcp->sigs[i].strong, ALGLEN) == 0) {
+			basis_queue(fh, off, end, ct->ct_leafsz, WKF_COPY);
+			psc_atomic64_add(&cksum_nunchanged, end - off);
+		} else if (gcp->level == 0)
+			basis_queue(fh, off, end, ct->ct_leafsz, 0);
+		else {
+			spinlock(&ct->ct_lock);
+			ct->ct_nreqs++;
+			freelock(&ct->ct_lock);
+
+			wk = work_getitem(OPC_GETCKSUM_REQ);
+			wk->wk_fh = fh;
+			wk->wk_fid = fh->fid;
+			wk->wk_off = off;
+			wk->wk_len = end - off;
+			wk->wk_level = gcp->level - 1;
+			lc_add(&workq, wk);
+		}
+	}
+
+	spinlock(&ct->ct_lock);
+	last = --ct->ct_nreqs == 0;
+	freelock(&ct->ct_lock);
+	if (last) {
+		basis_eof(fh, ct->ct_nleaves, 0);
+		basis_done(fh);
+	}
+}
+
+/*
+ * Hash our side of a --checksum file, then take up the root of the
+ * receiver's tree if it arrived meanwhile.
+ */
+void
+cktree_hash(struct filehandle *fh)
+{
+	struct cktree *ct = fh->cktree;
+	struct rpc_getcksum_rep *early;
+	unsigned char *leaves;
+
+	leaves = cksum_leaves(fh->fd, fh->base, ct->ct_size,
+	    ct->ct_leafsz);
+	if (leaves == NULL)
+		psync_fatal("checksum fid=%#"PRIx64, fh->fid);
+
+	spinlock(&ct->ct_lock);
+	ct->ct_leaves = leaves;
+	ct->ct_ready = 1;
+	early = ct->ct_early;
+	ct->ct_early = NULL;
+	freelock(&ct->ct_lock);
+
+	if (early) {
+		cktree_addnodes(fh, early);
+		PSCFREE(early);
+	}
+}
+
+/*
+ * The receiver has replied to the PUTNAME of a --delta or --checksum
+ * file with the size of the version it has.  One of the same size is
+ * compared by checksum; otherwise a delta is built against it.
+ */
+void
+basis_start(struct filehandle *fh, int rc, uint64_t basesize)
+{
+	if (rc || basesize == 0) {
+		basis_whole(fh);
+	} else if (fh->cktree && basesize == fh->len) {
+		if (fh->delta) {
+			delta_free(fh->delta);
+			fh->delta = NULL;
+		}
+		cktree_start(fh);
+	} else if (fh->delta) {
+		if (fh->cktree) {
+			cktree_free(fh->cktree);
+			fh->cktree = NULL;
+		}
+		delta_start(fh, basesize);
+	} else
+		basis_whole(fh);
+}
+
+void
+basis_addsums(struct rpc_getcksum_rep *gcp)
+{
+	struct filehandle *fh;
+
+	fh = filehandle_search(gcp->fid);
+	if (fh && fh->cktree)
+		cktree_addnodes(fh, gcp);
+	else if (fh && fh->delta)
+		delta_addsigs(fh, gcp);
+	else
+		psync_fatalx("unexpected GETCKSUM_REP from peer");
+}
+
+/*
+ * Fill in the GETCKSUM request for @wk and return the length of the
+ * reply to it.
+ */
+size_t
+getcksum_fill(struct work *wk, struct rpc_getcksum_req *gcq)
+{
+	struct filehandle *fh = wk->wk_fh;
+	uint64_t span;
+	int i;
+
+	memset(gcq, 0, sizeof(*gcq));
+	gcq->fid = wk->wk_fid;
+	gcq->off = wk->wk_off;
+	gcq->len = wk->wk_len;
+	if (fh->cktree) {
+		gcq->blksz = fh->cktree->ct_leafsz;
+		gcq->flags = RPC_GETCKSUM_F_TREE;
+		gcq->level = wk->wk_level;
+	} else
+		gcq->blksz = fh->delta->d_blksz;
+	for (span = gcq->blksz, i = 0; i < gcq->level; i++)
+		span *= CKTREE_FANOUT;
+	return (sizeof(struct rpc_getcksum_rep) +
+	    howmany(gcq->len, span) * sizeof(struct rpc_blksig));
+}
+
+/*
+ * Send a GETCKSUM along with those immediately following it in workq,
+ * as walking a digest tree queues one for every differing node, so the
+ * peer answers them in one round trip.  Batches are capped so the rest
+ * are left to other streams.  The first item that cannot join is put
+ * back.
+ */
+void
+getcksum_send(struct stream *st, struct work *wk)
+{
+	struct rpc_getcksum_req gcqs[GETCKSUMV_MAXREQS];
+	struct work *nwk;
+	size_t len, replen;
+	int n = 1;
+
+	if (wk->wk_flags & WKF_LOCAL) {
+		cktree_hash(wk->wk_fh);
+		return;
+	}
+
+	replen = sizeof(struct rpc_getcksumv_rep) +
+	    RPC_ALIGN(getcksum_fill(wk, &gcqs[0]));
+	while (psync_peer_features & RPC_READY_F_GETCKSUMV &&
+	    n < GETCKSUMV_MAXREQS && (nwk = lc_getnb(&workq)) != NULL) {
+		if (nwk->wk_type != OPC_GETCKSUM_REQ ||
+		    nwk->wk_flags & WKF_LOCAL) {
+			lc_addhead(&workq, nwk);
+			break;
+		}
+		len = RPC_ALIGN(getcksum_fill(nwk, &gcqs[n]));
+		if (replen + len > MAX_BUFSZ) {
+			lc_addhead(&workq, nwk);
+			break;
+		}
+		replen += len;
+		n++;
+		psc_pool_return(work_pool, nwk);
+	}
+
+	if (n > 1)
+		rpc_send_getcksumv_req(st, gcqs, n);
+	else
+		rpc_send_getcksum_req(st, gcqs[0].fid, gcqs[0].off,
+		    gcqs[0].len, gcqs[0].blksz, gcqs[0].flags,
+		    gcqs[0].level);
+}
+
+void
+putcopy_send(struct stream *st, struct work *wk)
+{
+	rpc_send_putcopy(st, wk->wk_fid, wk->wk_off, wk->wk_off,
+	    wk->wk_len);
+	psc_atomic64_add(&nbytes_xfer, wk->wk_len);
+	filehandle_dropref(wk->wk_fh);
+}
+
+/*
+ * Scan a segment of a --delta file.  Whoever finishes the last one
+ * tells the receiver how many chunks to expect.
+ */
+void
+delta_send(struct stream *st, struct work *wk)
+{
+	struct filehandle *fh = wk->wk_fh;
+	struct delta *d = fh->delta;
+
+	delta_scan(d, st, wk->wk_fid, fh->base, wk->wk_off, wk->wk_end,
+	    opts.zerocopy ? fh->fd : -1);
+	psc_atomic64_add(&nbytes_xfer, wk->wk_end - wk->wk_off);
+	if (psc_atomic32_dec_getnew(&d->d_nsegs) == 0) {
+		rpc_send_puteof(st, wk->wk_fid,
+		    psc_atomic64_read(&d->d_npieces), d->d_size, 0);
+		basis_done(fh);
+	}
+}
+
+void
+putname_done(struct work *wk)
+{
+	strarena_release(wk->wk_fn);
+	if (wk->wk_rflags & RPC_PUTNAME_F_INLINE) {
+		psc_atomic64_add(&nbytes_xfer, wk->wk_buflen);
+		PSCFREE(wk->wk_buf);
+	} else if (wk->wk_buf)
+		strarena_release(wk->wk_buf);
+}
+
+int
+putname_samedir(const char *a, const char *b)
+{
+	const char *sa, *sb;
+
+	sa = strrchr(a, '/');
+	sb = strrchr(b, '/');
+	if (sa == NULL || sb == NULL)
+		return (sa == sb);
+	return (sa - a == sb - b && strncmp(a, b, sa - a) == 0);
+}
+
+int
+putname_batch_add(struct rpc_putnames_batch *b, struct work *wk)
+{
+	return (rpc_putnames_add(b, wk->wk_fid, wk->wk_fn, &wk->wk_pstb,
+	    wk->wk_buf, wk->wk_buflen, wk->wk_nchunks, wk->wk_rflags));
+}
+
+/*
+ * Send a PUTNAME along with those immediately following it in workq
+ * for entries of the same directory, so the receiver handles them in
+ * one message.  The first item that cannot join is put back.
+ */
+void
+putname_send(struct wkrthr *wkrthr, struct work *wk)
+{
+	struct rpc_putnames_batch b;
+	struct work *nwk;
+
+	if ((psync_peer_features & RPC_READY_F_PUTNAMES) == 0 ||
+	    wk->wk_rflags & RPC_PUTNAME_F_TRYDIR)
+		goto single;
+
+	if (wkrthr->pnbuf == NULL)
+		wkrthr->pnbuf = PSCALLOC(PUTNAMES_MAXSZ);
+	rpc_putnames_init(&b, wkrthr->pnbuf, MIN(PUTNAMES_MAXSZ,
+	    psync_peer_maxmsglen));
+	if (!putname_batch_add(&b, wk))
+		goto single;
+
+	while ((nwk = lc_getnb(&workq)) != NULL) {
+		if (nwk->wk_type != OPC_PUTNAME_REQ ||
+		    nwk->wk_rflags & RPC_PUTNAME_F_TRYDIR ||
+		    !putname_samedir(wk->wk_fn, nwk->wk_fn) ||
+		    !putname_batch_add(&b, nwk)) {
+			lc_addhead(&workq, nwk);
+			break;
+		}
+		putname_done(nwk);
+		psc_pool_return(work_pool, nwk);
+	}
+	rpc_send_putnames_req(wkrthr->st, &b);
+	putname_done(wk);
+	return;
+
+ single:
+	rpc_send_putname_req(wkrthr->st, wk->wk_fid, wk->wk_fn,
+	    &wk->wk_pstb, wk->wk_buf, wk->wk_buflen, wk->wk_nchunks,
+	    wk->wk_rflags);
+	putname_done(wk);
+}
+
 void
 wkrthr_main(struct psc_thread *thr)
 {
 	struct wkrthr *wkrthr = thr->pscthr_private;
 	struct stream *st = wkrthr->st;
-	struct work *wk;
+	struct work *wk, chunk;
+	int copy;
 
 	while (pscthr_run(thr)) {
 		wk = lc_getwait(&workq);
@@ -194,6 +929,8 @@ wkrthr_main(struct psc_thread *thr)
 		case OPC_GETFILE_REQ:
 			rpc_send_getfile(st, wk->wk_xid, wk->wk_fn,
 			    wk->wk_basefn);
+			strarena_release(wk->wk_fn);
+			strarena_release(wk->wk_basefn);
 			break;
 		case OPC_PUTDATA:
 #if 0
@@ -214,31 +951,47 @@ wkrthr_main(struct psc_thread *thr)
 		}
 #endif
 
-			if (opts.sparse == 0 ||
-			    !pfl_memchk(wk->wk_fh->base + wk->wk_off, 0,
-			    wk->wk_len))
-				rpc_send_putdata(st, wk->wk_fid,
-				    wk->wk_off, wk->wk_fh->base +
-				    wk->wk_off, wk->wk_len,
-				    wk->wk_rflags);
-			psc_atomic64_add(&nbytes_xfer, wk->wk_len);
-			filehandle_dropref(wk->wk_fh);
+			if (wk->wk_flags & WKF_DELTA) {
+				delta_send(st, wk);
+			} else if (wk->wk_flags & WKF_HOLE) {
+				rpc_send_puthole(st, wk->wk_fid,
+				    wk->wk_off, wk->wk_len, wk->wk_rflags);
+				psc_atomic64_add(&nbytes_xfer, wk->wk_len);
+			} else if (wk->wk_flags & WKF_RANGE) {
+				copy = wk->wk_flags & WKF_COPY;
+
+				/* once put back, the range is not ours */
+				if (!work_carve(&workq, wk, &chunk))
+					wk = NULL;
+				if (copy)
+					putcopy_send(st, &chunk);
+				else
+					putdata_send(st, &chunk);
+			} else
+				putdata_send(st, wk);
 			break;
 		case OPC_PUTNAME_REQ:
-			rpc_send_putname_req(st, wk->wk_fid, wk->wk_fn,
-			    &wk->wk_stb, wk->wk_buf, wk->wk_nchunks,
-			    wk->wk_rflags);
-			PSCFREE(wk->wk_buf);
+			putname_send(wkrthr, wk);
+			break;
+		case OPC_GETCKSUM_REQ:
+			getcksum_send(st, wk);
+			break;
+		case OPC_PUTEOF:
+			rpc_send_puteof(st, wk->wk_fid, wk->wk_eofchunks,
+			    wk->wk_eofsize, wk->wk_flags & WKF_KEEP ?
+			    RPC_PUTEOF_F_KEEP : 0);
 			break;
 		}
 
-		psc_pool_return(work_pool, wk);
+		if (wk)
+			psc_pool_return(work_pool, wk);
 
 		if (exit_from_signal)
 			break;
 	}
 
 	rpc_send_done(st);
+	PSCFREE(wkrthr->pnbuf);
 
 	psynclog_diag("wkrthr done, close fd=%d", st->wfd);
 	close(st->wfd);
@@ -248,18 +1001,6 @@ wkrthr_main(struct psc_thread *thr)
 	freelock(&wkrthrs_lock);
 }
 
-struct work *
-work_getitem(int type)
-{
-	struct work *wk;
-
-	wk = psc_pool_get(work_pool);
-	memset(wk, 0, sizeof(*wk));
-	INIT_LISTENTRY(&wk->wk_lentry);
-	wk->wk_type = type;
-	return (wk);
-}
-
 int
 seen_fid(ino_t fid)
 {
@@ -281,22 +1022,140 @@ seen_fid(ino_t fid)
 	return (seen);
 }
 
+/*
+ * Determine the size of the data chunks a file is split into.  An
+ * explicit --block-size is honored as given.  Otherwise, the chunk size
+ * scales with the file so that large files are carried in fewer,
+ * larger messages and is rounded to the preferred I/O size of the
+ * source (the stripe size on parallel file systems).  Either way, a
+ * chunk must fit into the largest message the peer accepts.
+ */
+size_t
+getblksz(const struct stat *stb)
+{
+	size_t blksz, iosz, maxsz;
+
+	maxsz = psync_peer_maxmsglen - sizeof(struct rpc_putdata);
+
+	if (opts.block_size)
+		return (MIN(opts.block_size, maxsz));
+
+	blksz = stb->st_size / BLKSZ_NCHUNKS;
+	blksz = MAX(blksz, MIN_BLKSZ);
+	blksz = MIN(blksz, MAX_BLKSZ);
+
+	iosz = stb->st_blksize;
+	if (iosz > 0 && iosz <= maxsz)
+		blksz = roundup(blksz, iosz);
+	if (blksz > maxsz) {
+		blksz = maxsz;
+		if (iosz > 0 && iosz <= maxsz)
+			blksz -= blksz % iosz;
+	}
+	return (blksz);
+}
+
+/*
+ * Try to attach the contents of a small file to its PUTNAME so the file
+ * costs a single RPC and no filehandle on this side nor fcache entry on
+ * the receiver.  Files that may be hard linked to names sent later need
+ * an object namespace entry, and --partial needs the reply protocol, so
+ * those take the regular path, as do files to be compared against the
+ * receiver's copy with --checksum or --delta.
+ */
+int
+enqueue_inline(const char *srcfn, const struct stat *stb,
+    struct work *wk)
+{
+	ssize_t rc;
+	int fd;
+
+	if (opts.partial ||
+	    (opts.links && stb->st_nlink > 1) ||
+	    (uint64_t)stb->st_size > opts.inline_size ||
+	    (size_t)stb->st_size + PATH_MAX + sizeof(struct rpc_putname_req) >
+	    psync_peer_maxmsglen)
+		return (0);
+
+	fd = open(srcfn, O_RDONLY);
+	if (fd == -1)
+		err(1, "%s", srcfn);
+	wk->wk_buf = PSCALLOC(stb->st_size + 1);
+	rc = pread(fd, wk->wk_buf, stb->st_size + 1, 0);
+	close(fd);
+	if (rc != stb->st_size) {
+		/* file changed underneath us; send it the long way */
+		PSCFREE(wk->wk_buf);
+		return (0);
+	}
+	wk->wk_buflen = stb->st_size;
+	wk->wk_rflags |= RPC_PUTNAME_F_INLINE;
+	psc_atomic64_add(&nbytes_total, stb->st_size);
+	return (1);
+}
+
+/*
+ * Find the runs of a file that hold data with SEEK_DATA/SEEK_HOLE so
+ * holes are neither read nor sent.  A file system that cannot tell
+ * reports the whole file as data.
+ */
+int
+sparse_map(int fd, off_t size, struct extent **xp)
+{
+	struct extent *x = NULL;
+	off_t off = 0, end;
+	int n = 0;
+
+#ifdef SEEK_HOLE
+	for (; off < size; off = end) {
+		off = lseek(fd, off, SEEK_DATA);
+		if (off == -1 && errno == ENXIO)
+			/* hole until end of file */
+			break;
+		if (off == -1)
+			goto whole;
+		if (off >= size)
+			break;
+		end = lseek(fd, off, SEEK_HOLE);
+		if (end == -1)
+			goto whole;
+		end = MIN(end, size);
+
+		if (n % 16 == 0)
+			x = psc_realloc(x, (n + 16) * sizeof(*x), 0);
+		x[n].x_off = off;
+		x[n].x_end = end;
+		n++;
+	}
+	*xp = x;
+	return (n);
+
+ whole:
+	psynclog_warn("lseek SEEK_DATA");
+#endif
+	x = psc_realloc(x, sizeof(*x), 0);
+	x[0].x_off = 0;
+	x[0].x_end = size;
+	*xp = x;
+	return (1);
+}
+
 /*
  * @stb: stat(2) buffer only used during PUTs.
  */
 void
-enqueue_put(const char *srcfn, const char *dstfn,
+enqueue_put(struct strarena *sa, const char *srcfn, const char *dstfn,
     const struct stat *stb, int rflags)
 {
+	struct extent whole, *x;
 	struct filehandle *fh;
+	off_t size, prev, end;
 	struct work *wk;
-	off_t off = 0;
 	uint64_t fid;
 	size_t blksz;
+	int i, nx, delta, cktree;
 
-	blksz = opts.block_size ? (blksize_t)opts.block_size :
-	    stb->st_blksize;
-blksz = 64 * 1024;
+	blksz = getblksz(stb);
 
 	if (S_ISLNK(stb->st_mode)) {
 		if (!opts.links)
@@ -317,19 +1176,22 @@ blksz = 64 * 1024;
 	/* sending; push name first */
 	wk = work_getitem(OPC_PUTNAME_REQ);
 	wk->wk_fid = fid;
-	memcpy(&wk->wk_stb, stb, sizeof(wk->wk_stb));
-	strlcpy(wk->wk_fn, dstfn, sizeof(wk->wk_fn));
+	rpc_pack_stat(&wk->wk_pstb, stb);
+	wk->wk_pstb.blksize = blksz;
+	wk->wk_fn = strarena_dup(sa, dstfn);
 	wk->wk_rflags = rflags;
 	if (S_ISLNK(stb->st_mode)) {
+		char lnk[PATH_MAX];
 		int rc;
 
-		wk->wk_buf = PSCALLOC(PATH_MAX);
-		rc = readlink(srcfn, wk->wk_buf, PATH_MAX - 1);
+		rc = readlink(srcfn, lnk, sizeof(lnk) - 1);
 		if (rc == -1) {
 			psynclog_error("readlink %s", wk->wk_fn);
-			wk->wk_buf[0] = '\0';
-		} else
-			wk->wk_buf[rc] = '\0';
+			rc = 0;
+		}
+		lnk[rc] = '\0';
+		wk->wk_buf = strarena_dup(sa, lnk);
+		wk->wk_buflen = rc + 1;
 	}
 	psynclog_diag("enqueue PUTNAME_REQ localfn=%s dstfn=%s flags=%d",
 	    srcfn, wk->wk_fn, rflags);
@@ -341,63 +1203,137 @@ blksz = 64 * 1024;
 		return;
 	}
 
-	fh = filehandle_new(fid, stb->st_size);
+	delta = stb->st_size && opts.delta &&
+	    psync_peer_features & RPC_READY_F_DELTA;
+	cktree = stb->st_size && opts.checksum &&
+	    psync_peer_features & RPC_READY_F_CKTREE;
+
+	if (!delta && !cktree && enqueue_inline(srcfn, stb, wk)) {
+		lc_add(&workq, wk);
+		pscthr_yield();
+		return;
+	}
+
+	/*
+	 * With read-ahead, data is read into buffers instead of mapped;
+	 * files compared against a basis are scanned or hashed through
+	 * the mapping regardless.
+	 */
+	fh = filehandle_new(fid, opts.read_ahead && !delta && !cktree ?
+	    0 : stb->st_size);
 	if (fh == NULL)
 		return;
 
 	if (opts.partial)
 		psc_compl_init(&fh->cmpl);
 
-	wk->wk_nchunks = howmany(stb->st_size, blksz);
-	lc_add(&workq, wk);
-
 	fh->fd = open(srcfn, O_RDONLY);
 	if (fh->fd == -1)
 		err(1, "%s", srcfn);
 
-	if (stb->st_size) {
+	if (delta || cktree) {
+		/*
+		 * Nothing goes out before the receiver tells whether it
+		 * has a version to compare against; see basis_start().
+		 * Our reference passes on to the comparison.
+		 */
 		fh->base = mmap(NULL, stb->st_size, PROT_READ,
 		    MAP_FILE | MAP_PRIVATE, fh->fd, 0);
 		if (fh->base == MAP_FAILED)
 			err(1, "mmap %s", srcfn);
+		if (delta)
+			fh->delta = delta_new(stb->st_size, blksz);
+		if (cktree)
+			fh->cktree = cktree_new(stb->st_size, blksz);
+		psc_atomic32_inc(&nranges);
+		psc_atomic64_add(&nbytes_total, stb->st_size);
+
+		wk->wk_rflags |= RPC_PUTNAME_F_BASIS;
+		wk->wk_nchunks = 0;
+		lc_add(&workq, wk);
+		pscthr_yield();
+		return;
 	}
 
-	psc_atomic64_add(&nbytes_total, stb->st_size);
+	/* the name goes out first but has to know the number of pieces */
+	size = stb->st_size;
+	if (opts.sparse && size)
+		nx = sparse_map(fh->fd, size, &x);
+	else {
+		x = &whole;
+		nx = size ? 1 : 0;
+		whole.x_off = 0;
+		whole.x_end = size;
+	}
+	wk->wk_nchunks = 0;
+	for (i = 0, prev = 0; i < nx; prev = x[i++].x_end)
+		wk->wk_nchunks += (x[i].x_off > prev) +
+		    howmany(x[i].x_end - x[i].x_off, blksz);
+	wk->wk_nchunks += prev < size;
+	lc_add(&workq, wk);
 
-	/* push data chunks */
-	for (; off < stb->st_size; off += blksz) {
-		wk = work_getitem(OPC_PUTDATA);
-		wk->wk_fh = fh;
+	if (size && !opts.read_ahead) {
+		fh->base = mmap(NULL, size, PROT_READ,
+		    MAP_FILE | MAP_PRIVATE, fh->fd, 0);
+		if (fh->base == MAP_FAILED)
+			err(1, "mmap %s", srcfn);
+	}
 
-		wk->wk_fid = fid;
-		wk->wk_stb.st_size = stb->st_size;
+	psc_atomic64_add(&nbytes_total, size);
 
-		if (off + (off_t)blksz >= stb->st_size)
-			wk->wk_rflags |= RPC_PUTDATA_F_LAST;
+	/*
+	 * Push an item describing each run of data of the file; chunks
+	 * are carved off it as workers get to it, and each holds a
+	 * filehandle reference.  Holes are sent as is.
+	 */
+	for (i = 0, prev = 0; i <= nx; prev = x[i++].x_end) {
+		end = i < nx ? x[i].x_off : size;
+		if (end > prev) {
+			wk = work_getitem(OPC_PUTDATA);
+			wk->wk_flags |= WKF_HOLE;
+			wk->wk_fid = fid;
+			wk->wk_off = prev;
+			wk->wk_len = end - prev;
+			if (end == size)
+				wk->wk_rflags |= RPC_PUTDATA_F_LAST;
+			lc_add(&workq, wk);
+		}
+		if (i == nx)
+			break;
 
 		spinlock(&fh->lock);
 		fh->refcnt++;
 		freelock(&fh->lock);
 
-		wk->wk_off = off;
-		if (off + (off_t)blksz > stb->st_size)
-			wk->wk_len = stb->st_size % blksz;
-		else
-			wk->wk_len = blksz;
-		lc_add(&workq, wk);
-
-		pscthr_yield();
+		wk = work_getitem(OPC_PUTDATA);
+		wk->wk_flags |= WKF_RANGE;
+		if (x[i].x_end == size)
+			wk->wk_flags |= WKF_LASTRANGE;
+		wk->wk_fh = fh;
+		wk->wk_fid = fid;
+		wk->wk_off = x[i].x_off;
+		wk->wk_end = x[i].x_end;
+		wk->wk_len = blksz;
+		psc_atomic32_inc(&nranges);
+		lc_add(opts.read_ahead ? &readq : &workq, wk);
 	}
+	if (x != &whole)
+		PSCFREE(x);
 	filehandle_dropref(fh);
+	pscthr_yield();
 }
 
-int
-push_putfile_walkcb(FTSENT *f, void *arg)
+/*
+ * Queue the transfer of one file found by a walk.  This may be called
+ * concurrently by the walker threads.
+ */
+void
+push_putfile(struct walkarg *wa, const char *fn, int level,
+    const struct stat *stb)
 {
-	struct walkarg *wa = arg;
 	char dstfn[PATH_MAX];
 	const char *t;
-	int rc = 0;
+	int rc, rflags;
 
 #if 0
 	struct filterpat *fp;
@@ -412,7 +1348,7 @@ push_putfile_walkcb(FTSENT *f, void *arg)
 		return;
 	}
 #endif
-	t = f->fts_path + wa->skip;
+	t = fn + wa->skip;
 	while (*t == '/')
 		t++;
 	rc = snprintf(dstfn, sizeof(dstfn), "%s%s%s", wa->prefix, t[0] ?
@@ -422,10 +1358,224 @@ push_putfile_walkcb(FTSENT *f, void *arg)
 ///	if (f->fts_level == 0)
 //		strlcat(dstfn, pfl_basename(fn), sizeof(dstfn));
 
-	if (f->fts_level > 0)
-		wa->rflags &= ~RPC_PUTNAME_F_TRYDIR;
+	rflags = wa->rflags;
+	if (level > 0)
+		rflags &= ~RPC_PUTNAME_F_TRYDIR;
+
+	enqueue_put(wa->arena, fn, dstfn, stb, rflags);
+}
+
+int
+push_putfile_walkcb(FTSENT *f, void *arg)
+{
+	if (cksum_cache_skip(f->fts_path))
+		return (0);
+	push_putfile(arg, f->fts_path, f->fts_level, f->fts_statp);
+	return (0);
+}
+
+/*
+ * Parallel tree walk.  Each walker owns a deque of directories still to
+ * be read: it pushes the subdirectories it finds onto its tail and takes
+ * its next directory from there too, depth first, while idle walkers
+ * steal from the head where the largest unexplored subtrees are.  A
+ * directory is queued for transfer before it is pushed, so its PUTNAME
+ * is always queued ahead of those of its entries.
+ */
+struct walkdir {
+	struct walkdir		*wd_prev;
+	struct walkdir		*wd_next;
+	int			 wd_level;
+	char			 wd_path[0];
+};
+
+struct walker {
+	struct walk		*wr_walk;
+	psc_spinlock_t		 wr_lock;
+	struct walkdir		*wr_head;	/* stolen from */
+	struct walkdir		*wr_tail;	/* owner end */
+	pthread_t		 wr_pthread;
+};
+
+struct walk {
+	struct walkarg		*w_wa;
+	int			 w_flags;
+	int			 w_nwalkers;
+	struct walker		*w_walkers;
+	psc_atomic32_t		 w_npending;	/* dirs queued or being read */
+};
+
+struct walkthr {
+	struct walker		*wt_walker;
+};
+
+void
+walkdir_push(struct walker *wr, const char *fn, int level)
+{
+	struct walkdir *wd;
+	size_t len;
+
+	len = strlen(fn) + 1;
+	wd = PSCALLOC(sizeof(*wd) + len);
+	memcpy(wd->wd_path, fn, len);
+	wd->wd_level = level;
+
+	psc_atomic32_inc(&wr->wr_walk->w_npending);
+	spinlock(&wr->wr_lock);
+	wd->wd_prev = wr->wr_tail;
+	if (wr->wr_tail)
+		wr->wr_tail->wd_next = wd;
+	else
+		wr->wr_head = wd;
+	wr->wr_tail = wd;
+	freelock(&wr->wr_lock);
+}
+
+struct walkdir *
+walkdir_pop(struct walker *wr, int steal)
+{
+	struct walkdir *wd;
+
+	spinlock(&wr->wr_lock);
+	wd = steal ? wr->wr_head : wr->wr_tail;
+	if (wd) {
+		if (wd->wd_prev)
+			wd->wd_prev->wd_next = wd->wd_next;
+		else
+			wr->wr_head = wd->wd_next;
+		if (wd->wd_next)
+			wd->wd_next->wd_prev = wd->wd_prev;
+		else
+			wr->wr_tail = wd->wd_prev;
+	}
+	freelock(&wr->wr_lock);
+	return (wd);
+}
+
+void
+walkdir_read(struct walker *wr, struct walkdir *wd)
+{
+	struct walk *w = wr->wr_walk;
+	char fn[PATH_MAX];
+	struct dirent *dent;
+	struct stat stb;
+	DIR *dir;
+	int rc;
+
+	dir = opendir(wd->wd_path);
+	if (dir == NULL) {
+		warn("%s", wd->wd_path);
+		return;
+	}
+	while ((dent = readdir(dir)) != NULL) {
+		if (strcmp(dent->d_name, ".") == 0 ||
+		    strcmp(dent->d_name, "..") == 0 ||
+		    strcmp(dent->d_name, CKCACHE_DIR) == 0)
+			continue;
+		rc = snprintf(fn, sizeof(fn), "%s/%s", wd->wd_path,
+		    dent->d_name);
+		if (rc == -1 || rc >= (int)sizeof(fn)) {
+			warnx("%s/%s: name too long", wd->wd_path,
+			    dent->d_name);
+			continue;
+		}
+		if (fstatat(dirfd(dir), dent->d_name, &stb,
+		    AT_SYMLINK_NOFOLLOW) == -1) {
+			warn("%s", fn);
+			continue;
+		}
+		if (w->w_flags & PFL_FILEWALKF_VERBOSE)
+			warnx("processing %s", fn);
+		push_putfile(w->w_wa, fn, wd->wd_level + 1, &stb);
+		if (S_ISDIR(stb.st_mode))
+			walkdir_push(wr, fn, wd->wd_level + 1);
+	}
+	closedir(dir);
+}
 
-	enqueue_put(f->fts_path, dstfn, f->fts_statp, wa->rflags);
+void
+walkthr_main(struct psc_thread *thr)
+{
+	struct walkthr *wt = thr->pscthr_private;
+	struct walker *wr = wt->wt_walker;
+	struct walk *w = wr->wr_walk;
+	struct walkdir *wd;
+	int i;
+
+	while (!exit_from_signal) {
+		wd = walkdir_pop(wr, 0);
+		for (i = 0; wd == NULL && i < w->w_nwalkers; i++)
+			if (&w->w_walkers[i] != wr)
+				wd = walkdir_pop(&w->w_walkers[i], 1);
+		if (wd == NULL) {
+			if (psc_atomic32_read(&w->w_npending) == 0)
+				break;
+			usleep(1000);
+			continue;
+		}
+		walkdir_read(wr, wd);
+		PSCFREE(wd);
+		psc_atomic32_dec(&w->w_npending);
+	}
+}
+
+/*
+ * Walk a file tree and queue everything in it for transfer.
+ */
+int
+psync_walk(const char *fn, int travflags, struct walkarg *wa)
+{
+	struct psc_thread *thr;
+	struct walkdir *wd;
+	struct walker *wr;
+	struct walkthr *wt;
+	struct stat stb;
+	struct walk w;
+	int i;
+
+	if (opts.walkers < 2 || (travflags & PFL_FILEWALKF_RECURSIVE) == 0)
+		return (pfl_filewalk(fn, travflags, NULL,
+		    push_putfile_walkcb, wa));
+
+	if (stat(fn, &stb) == -1) {
+		warn("%s", fn);
+		return (errno);
+	}
+	if (travflags & PFL_FILEWALKF_VERBOSE)
+		warnx("processing %s", fn);
+	push_putfile(wa, fn, 0, &stb);
+	if (!S_ISDIR(stb.st_mode))
+		return (0);
+
+	memset(&w, 0, sizeof(w));
+	w.w_wa = wa;
+	w.w_flags = travflags;
+	w.w_nwalkers = opts.walkers;
+	w.w_walkers = PSCALLOC(w.w_nwalkers * sizeof(*w.w_walkers));
+	for (i = 0; i < w.w_nwalkers; i++) {
+		wr = &w.w_walkers[i];
+		wr->wr_walk = &w;
+		INIT_SPINLOCK(&wr->wr_lock);
+	}
+	walkdir_push(&w.w_walkers[0], fn, 0);
+
+	for (i = 0; i < w.w_nwalkers; i++) {
+		wr = &w.w_walkers[i];
+		thr = pscthr_init(THRT_WALK, walkthr_main, NULL,
+		    sizeof(*wt), "walkthr%d", i);
+		wt = thr->pscthr_private;
+		wt->wt_walker = wr;
+		wr->wr_pthread = thr->pscthr_pthread;
+		pscthr_setready(thr);
+	}
+	for (i = 0; i < w.w_nwalkers; i++)
+		pthread_join(w.w_walkers[i].wr_pthread, NULL);
+
+	/* left over if interrupted */
+	for (i = 0; i < w.w_nwalkers; i++)
+		while ((wd = walkdir_pop(&w.w_walkers[i], 0)) != NULL)
+			PSCFREE(wd);
+	PSCFREE(w.w_walkers);
 	return (0);
 }
 
@@ -445,12 +1595,15 @@ int
 walkfiles(int mode, const char *srcfn, int travflags, int rflags,
     const char *dstfn)
 {
+	struct strarena arena;
 	char buf[PATH_MAX];
 	const char *finalfn;
 	struct stat tstb;
 	struct work *wk;
 	int rc;
 
+	strarena_init(&arena);
+
 	if (mode == MODE_PUT) {
 		struct walkarg wa;
 		char *p;
@@ -462,8 +1615,10 @@ walkfiles(int mode, const char *srcfn, int travflags, int rflags,
 			wa.skip = 0;
 		wa.rflags = rflags;
 		wa.prefix = dstfn;
-		return (pfl_filewalk(srcfn, travflags, NULL,
-		    push_putfile_walkcb, &wa));
+		wa.arena = &arena;
+		rc = psync_walk(srcfn, travflags, &wa);
+		strarena_destroy(&arena);
+		return (rc);
 	}
 
 	/* otherwise, the operation is a FETCH */
@@ -488,11 +1643,12 @@ walkfiles(int mode, const char *srcfn, int travflags, int rflags,
 
 	wk = work_getitem(OPC_GETFILE_REQ);
 	wk->wk_xid = psc_atomic64_inc_getnew(&psync_xid);
-	strlcpy(wk->wk_fn, srcfn, sizeof(wk->wk_fn));
-	strlcpy(wk->wk_basefn, finalfn, sizeof(wk->wk_basefn));
+	wk->wk_fn = strarena_dup(&arena, srcfn);
+	wk->wk_basefn = strarena_dup(&arena, finalfn);
 //	if (!opts.partial)
 //		truncate(finalfn, 0);
 	lc_add(&workq, wk);
+	strarena_destroy(&arena);
 
 	return (0);
 }
@@ -712,6 +1868,16 @@ spawn_worker_threads(struct stream *st)
 	spinlock(&rcvthrs_lock);
 	push(&rcvthrs, thr);
 	freelock(&rcvthrs_lock);
+
+	if (opts.read_ahead) {
+		thr = pscthr_init(THRT_RD, rdthr_main, NULL, 0,
+		    "rdthr%d", n);
+		pscthr_setready(thr);
+
+		spinlock(&rdthrs_lock);
+		push(&rdthrs, thr);
+		freelock(&rdthrs_lock);
+	}
 }
 
 int
@@ -801,7 +1967,7 @@ puppet_head_mode(void)
 
 	psynclog_diag("rcvthrs done");
 
-	lc_kill(&workq);
+	workq_kill();
 
 	while (psc_dynarray_len(&wkrthrs))
 		usleep(10000);
@@ -812,6 +1978,10 @@ puppet_head_mode(void)
 
 	fcache_destroy();
 
+	/* stdout carries the stream */
+	if (opts.stats)
+		print_stats(stderr);
+
 	return (0);
 }
 
@@ -895,6 +2065,78 @@ dispthr_main(struct psc_thread *thr)
 	    (int)(d.tv_nsec / 10000000), totalbuf, ratebuf, ce_seq);
 }
 
+/*
+ * Print --stats summary.  CPU time is reported per GiB of file data so
+ * the cost of the data path can be compared across transfer modes.
+ */
+void
+print_stats(FILE *fp)
+{
+	char buf[PSCFMT_HUMAN_BUFSIZ];
+	struct rusage ru;
+	double usr, sys, gib;
+	uint64_t nb, nmsgs, nreads, nwrites;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1) {
+		psynclog_warn("getrusage");
+		return;
+	}
+	usr = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6;
+	sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+
+	nb = psc_atomic64_read(&nbytes_xfer);
+	gib = nb / (1024. * 1024 * 1024);
+	psc_fmt_human(buf, nb);
+
+	fprintf(fp, "data transferred: %s%s%s\n", buf,
+	    opts.zerocopy ? " (zero-copy)" : "",
+	    opts.splice ? " (splice)" : "");
+	fprintf(fp, "cpu time: %.2fs user  %.2fs sys", usr, sys);
+	if (gib > 0)
+		fprintf(fp, "  (%.3fs/GiB)", (usr + sys) / gib);
+	fprintf(fp, "\n");
+
+	nmsgs = psc_atomic64_read(&stream_nmsgs);
+	if (nmsgs)
+		fprintf(fp, "send syscalls per message: %.3f (%"PRIu64" msgs)\n",
+		    (double)psc_atomic64_read(&stream_nsyscalls) / nmsgs,
+		    nmsgs);
+
+	nreads = psc_atomic64_read(&stream_nrcvreads);
+	if (nreads)
+		fprintf(fp, "messages per receive syscall: %.3f (%"PRIu64
+		    " msgs)\n", (double)psc_atomic64_read(
+		    &stream_nrcvmsgs) / nreads,
+		    psc_atomic64_read(&stream_nrcvmsgs));
+
+	nwrites = psc_atomic64_read(&io_nwrites);
+	if (nwrites) {
+		psc_fmt_human(buf, psc_atomic64_read(&io_nwbytes) / nwrites);
+		fprintf(fp, "average write size: %s (%"PRIu64" writes)\n",
+		    buf, nwrites);
+	}
+
+	nb = psc_atomic64_read(&delta_nmatched);
+	if (nb) {
+		char mbuf[PSCFMT_HUMAN_BUFSIZ];
+
+		psc_fmt_human(buf, psc_atomic64_read(&delta_nliteral));
+		psc_fmt_human(mbuf, nb);
+		fprintf(fp, "delta: %s literal, %s matched\n", buf, mbuf);
+	}
+
+	nb = psc_atomic64_read(&cksum_nunchanged);
+	if (nb) {
+		psc_fmt_human(buf, nb);
+		fprintf(fp, "unchanged by checksum: %s\n", buf);
+	}
+
+	nb = psc_atomic64_read(&fcache_nreopens);
+	if (nb)
+		fprintf(fp, "files reopened: %"PRIu64" (%d descriptors "
+		    "budgeted)\n", nb, fcache_maxfds);
+}
+
 #if defined(SYS_sched_getaffinity) && !defined(CPU_COUNT)
 #  define CPU_COUNT(set) _cpu_count(set)
 int
@@ -979,7 +2221,7 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	char *p, *fn, *host, *dstfn, *dstdir;
+	char *p, *fn, *host, *dstfn, *dstdir, xopts[512];
 	int mode, travflags, rflags, i, rv, rc;
 	struct psc_thread *dispthr;
 	struct sigaction sa;
@@ -1024,10 +2266,24 @@ main(int argc, char *argv[])
 	psc_hashtbl_init(&ino_hashtbl, 0, struct ino_entry, i_fid,
 	    i_hentry, 1531, NULL, "ino");
 
+	zero_init();
+	digest_init();
 	fcache_init();
+	if (opts.async_writes)
+		aio_init();
+	if (opts.coalesce)
+		coalesce_init();
 
 	lc_reginit(&workq, struct work, wk_lentry, "workq");
 
+	if (opts.read_ahead) {
+		lc_reginit(&readq, struct work, wk_lentry, "readq");
+		psc_poolmaster_init(&rabuf_poolmaster, struct buf,
+		    lentry, PPMF_AUTO, opts.read_ahead, opts.read_ahead,
+		    opts.read_ahead, NULL, NULL, NULL, "rabuf");
+		rabuf_pool = psc_poolmaster_getmgr(&rabuf_poolmaster);
+	}
+
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = handle_signal;
 	if (sigaction(SIGINT, &sa, NULL) == -1)
@@ -1120,14 +2376,57 @@ main(int argc, char *argv[])
 
 	pfl_random_getbytes(psync_authbuf, sizeof(psync_authbuf));
 
+	/* options the puppet needs when it is the sender */
+	rc = snprintf(xopts, sizeof(xopts), "--inline-size=%"PRIu64" ",
+	    opts.inline_size);
+	if (opts.block_size)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--block-size=%"PRIu64" ", opts.block_size);
+	if (opts.zerocopy)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--zero-copy ");
+	if (opts.splice)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--splice ");
+	if (opts.async_writes)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--async-writes=%d ", opts.async_writes);
+	if (opts.coalesce)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--coalesce=%"PRIu64" --coalesce-mem=%"PRIu64" ",
+		    opts.coalesce, opts.coalesce_mem);
+	if (opts.stats)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc, "--stats ");
+	if (opts.tmpfile)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc, "--tmpfile ");
+	if (opts.preallocate)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--preallocate ");
+	if (opts.delta)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc, "--delta ");
+	if (opts.checksum)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc, "--checksum ");
+	if (opts.checksum_cache)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--checksum-cache ");
+	if (opts.digest != -1)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--digest=%s ", digest_byid(opts.digest));
+	if (opts.read_ahead)
+		rc += snprintf(xopts + rc, sizeof(xopts) - rc,
+		    "--read-ahead=%d --read-ahead-file=%d ",
+		    opts.read_ahead, opts.read_ahead_file);
+	snprintf(xopts + rc, sizeof(xopts) - rc, "--walkers=%d "
+	    "--objns-depth=%d ", opts.walkers, opts.objns_depth);
+
 	/*
 	 * XXX add:
 	 *	--exclude filter patterns
-	 *	--block-size
 	 */
 	st = stream_cmdopen("%s %s %s --PUPPET=%d --dstdir=%s --HEAD "
-	    "%s%s%s-%s%s%s%s%sN%d",
+	    "%s%s%s%s-%s%s%s%s%sN%d",
 	    opts.rsh, host, opts.psync_path, opts.puppet, dstdir,
+	    xopts,
 	    opts.devices	? "--devices " : "",
 	    opts.partial	? "--partial " : "",
 	    opts.specials	? "--specials " : "",
@@ -1178,7 +2477,7 @@ main(int argc, char *argv[])
 		if (rv)
 			rc = rv;
 	}
-	lc_kill(&workq);
+	workq_kill();
 
 	while (psc_dynarray_len(&rcvthrs) || psc_dynarray_len(&wkrthrs))
 		usleep(10000);
@@ -1187,5 +2486,8 @@ main(int argc, char *argv[])
 
 	fcache_destroy();
 
+	if (opts.stats)
+		print_stats(stdout);
+
 	exit(rc);
 }
@@ -36,38 +36,158 @@
 #include "pfl/pthrutil.h"
 
 struct iovec;
+struct hdr;
+struct rpc_blksig;
+struct rpc_getcksum_rep;
+struct sendreq;
 struct stat;
 
 struct psc_thread;
 
 #define MAX_STREAMS		64
 
+/* bounds on the size of file data carried in a single PUTDATA */
+#define MIN_BLKSZ		(64 * 1024)
+#define MAX_BLKSZ		(64 * 1024 * 1024)
+#define BLKSZ_NCHUNKS		256		/* target chunks per file */
+
+/* files up to this size are carried inside their PUTNAME */
+#define DEF_INLINE_SIZE		(32 * 1024)
+
+/* default read-ahead chunks in flight per file */
+#define DEF_READ_AHEAD_FILE	4
+#define DEF_WALKERS		4
+#define DEF_COALESCE_MEM	(256 * 1024 * 1024)
+#define COALESCE_TIMEOUT_MS	200
+#define MAX_WALKERS		256
+
+/* object namespace fan-out, in hex digits of directory name */
+#define DEF_OBJNS_DEPTH		2
+#define MAX_OBJNS_DEPTH		3
+#define OBJNS_NAMELEN		17		/* %016x + NUL */
+#define OBJNS_BASENAMELEN	22		/* %016x.base/.inl + NUL */
+
+#define CKCACHE_DIR		".psync-cksum"	/* --checksum-cache sidecars */
+
+/* --delta basis blocks */
+#define DELTA_NBLKS		65536		/* target blocks per file */
+#define DELTA_MINBLKSZ		(8 * 1024)
+#define DELTA_MAXBLKSZ		(1024 * 1024)
+#define DELTA_REQBLKS		4096		/* signatures per GETCKSUM */
+#define DELTA_SEGSZ		(256 * 1024 * 1024)	/* scanned per work item */
+
+/* --checksum digest tree */
+#define CKTREE_FANOUT		16
+#define CKTREE_MAXHEIGHT	8
+
+/* digest algorithms, by bit in the READY digests mask */
+enum {
+	DIGEST_SHA256,
+	DIGEST_BLAKE2B,
+	DIGEST_BLAKE3,
+	DIGEST_XXH128,
+	NDIGESTS
+};
+
+#define STREAM_RBUFSZ		(1024 * 1024)	/* receive buffer */
+#define STREAM_MAXIOV		64
+
 struct stream {
 	int			 rfd;
 	int			 wfd;
 	int			 done;
+	int			 nozerocopy;	/* kernel refused splice */
+	mode_t			 wtype;		/* file type of wfd */
+	int			 writing;	/* a thread is draining sendq */
+	struct sendreq		*sendq;
+	struct sendreq	       **sendq_tailp;
+	struct psc_waitq	 wq;
 	psc_spinlock_t		 lock;
+
+	/* receive side, only touched by the rcvthr */
+	char			*rbuf;		/* STREAM_RBUFSZ */
+	size_t			 rpos;		/* next unparsed byte */
+	size_t			 rlen;		/* end of data read */
+	char			*xbuf;		/* out of line bodies */
+	size_t			 xbufsz;
+	size_t			 rleft;		/* of body, still in rfd */
+	mode_t			 rtype;		/* file type of rfd */
+	int			 nosplicein;
+	int			 rpipe[2];	/* splice bounce for sockets */
 };
 
 /* reference to a file that is being received */
 struct file {
-	struct pfl_hashentry	 hentry;
+	struct file		*next;		/* fcache hash chain */
+	struct psc_listentry	 lentry;	/* fcache idle list */
 	uint64_t		 fid;
 	psc_spinlock_t		 lock;
-	int			 fd;
+	int			 fd;		/* -1 while closed for budget */
+	int			 basefd;	/* --delta/--checksum basis or -1 */
+	char			*basefn;	/* basis stashed to be restored */
+	unsigned char		*ck_leaves;	/* basis chunk digests */
+	unsigned char		*ck_new;	/* --checksum-cache digests */
+	unsigned char		*ck_newok;	/* which of ck_new are known */
+	off_t			 ck_newsize;
+	size_t			 ck_newleafsz;
+	uint64_t		 ck_nleaves;
+	size_t			 ck_leafsz;
+	char			*path;		/* --tmpfile name once linked */
 	int			 refcnt;
 	uint64_t		 nchunks_seen;
 	uint64_t		 nchunks;
 	struct pfl_timespec	 tim[2];	/* mtime/atime upon completion */
 	uint32_t		 flags;
 	mode_t			 mode;		/* permission modes upon completion */
+
+	/* adjacent chunks held back to be written together */
+	pthread_mutex_t		 cb_mutex;
+	char			*cb_buf;
+	off_t			 cb_off;	/* file offset of cb_buf */
+	size_t			 cb_len;
+	size_t			 cb_winsz;	/* write size to aim for */
+	uint64_t		 cb_nchunks;	/* chunks held */
+	int			 cb_last;	/* holding the last chunk */
+	int			 cb_nomore;	/* saw last, write through */
+	uint64_t		 cb_stamp;	/* when first held, in ms */
 };
 
 #define FF_SAWLAST		(1 << 0)
 #define FF_LINKED		(1 << 1)
+#define FF_OPENING		(1 << 2)	/* fd being (re)opened */
+#define FF_IDLE			(1 << 3)	/* on fcache idle list */
+#define FF_ANON			(1 << 4)	/* --tmpfile not yet linked */
+
+enum {
+	THRT_AIO,
+	THRT_CKSUM,
+	THRT_COAL,
+	THRT_DISP,
+	THRT_FIN,
+	THRT_MAIN,
+	THRT_RCV,
+	THRT_OPSTIMER,
+	THRT_RD,
+	THRT_WALK,
+	THRT_WKR
+};
+
+/* a chunk of file data being written out asynchronously */
+struct wrbuf {
+	struct psc_listentry	 wb_lentry;
+	struct file		*wb_f;
+	void			*wb_buf;
+	size_t			 wb_bufsz;
+	const char		*wb_data;	/* within wb_buf */
+	size_t			 wb_len;
+	off_t			 wb_off;
+	uint64_t		 wb_nchunks;	/* chunks covered */
+	int			 wb_last;
+};
 
 struct wkrthr {
 	struct stream		*st;
+	char			*pnbuf;		/* PUTNAMES batch */
 };
 
 struct rcvthr {
@@ -87,7 +207,51 @@ struct filehandle {
 	psc_spinlock_t		 lock;
 	struct psc_waitq	 wq;
 	struct psc_compl	 cmpl;
-	size_t			 len;
+	size_t			 len;		/* length of mapping */
+	int			 ra_inflight;	/* read-ahead buffers in use */
+	struct delta		*delta;		/* --delta state until sent */
+	struct cktree		*cktree;	/* --checksum state until sent */
+};
+
+/*
+ * A file being sent as a delta against the version the receiver has:
+ * the signatures of the blocks of that basis are gathered first, then
+ * the file is scanned for them in segments.
+ */
+struct delta {
+	psc_spinlock_t		 d_lock;
+	size_t			 d_blksz;	/* of basis blocks */
+	size_t			 d_sendsz;	/* largest literal chunk */
+	off_t			 d_size;	/* of file being sent */
+	off_t			 d_basesize;
+	uint32_t		 d_nblks;	/* in basis */
+	uint32_t		 d_nfull;	/* of d_blksz exactly */
+	int			 d_nreqs;	/* GETCKSUMs outstanding */
+	int			 d_failed;	/* basis became unreadable */
+	struct rpc_blksig	*d_sigs;
+	uint32_t		*d_tab;		/* weak sum -> block + 1 */
+	uint32_t		*d_next;	/* d_tab chains */
+	int			 d_tabshift;
+	psc_atomic32_t		 d_nsegs;	/* left to scan */
+	psc_atomic64_t		 d_npieces;	/* PUTDATAs sent */
+};
+
+/*
+ * A file compared by --checksum against the version the receiver has.
+ * Both sides hash the file in chunks and build a tree of digests over
+ * them; the receiver is asked for the nodes of one level at a time,
+ * starting at the root, and only under those that differ.
+ */
+struct cktree {
+	psc_spinlock_t		 ct_lock;
+	off_t			 ct_size;
+	size_t			 ct_leafsz;	/* == chunk size */
+	uint64_t		 ct_nleaves;
+	int			 ct_height;	/* of the root */
+	unsigned char		*ct_leaves;	/* digests of our chunks */
+	int			 ct_ready;	/* ct_leaves filled in */
+	int			 ct_nreqs;	/* GETCKSUMs outstanding */
+	struct rpc_getcksum_rep	*ct_early;	/* root before ct_ready */
 };
 
 struct buf {
@@ -96,10 +260,26 @@ struct buf {
 	size_t			 len;
 };
 
+/*
+ * Names queued during a walk are copied into shared blocks instead of
+ * each work item carrying PATH_MAX bytes.  A block is freed once the
+ * walk has moved past it and all strings in it have been released.
+ */
+#define STRARENA_BLKSZ		(64 * 1024)
+
+struct strarena_blk;
+
+struct strarena {
+	psc_spinlock_t		 sa_lock;
+	struct strarena_blk	*sa_blk;	/* block being filled */
+	size_t			 sa_off;
+};
+
 struct walkarg {
 	const char		*prefix;
 	int			 skip;
 	int			 rflags;
+	struct strarena		*arena;
 };
 
 #define push(da, ent)							\
@@ -131,27 +311,103 @@ int	  parsesize(uint64_t *, const char *, uint64_t);
 
 void	  rcvthr_main(struct psc_thread *);
 
-void	  objns_makepath(char *, uint64_t);
+int	  objns_lookup(uint64_t, char *);
+int	  objns_stashbasis(uint64_t, const char *);
+int	  objns_inline(uint64_t, char *);
+int	  objns_usetmpfile(void);
 
 ssize_t	  atomicio(int, int, void *, size_t);
 
 struct file *
 	  fcache_search(uint64_t);
 void	  fcache_close(struct file *);
+void	  fcache_setbasis(struct file *, int, const char *);
+uint64_t  fcache_keepbasis(struct file *, off_t);
 void	  fcache_init(void);
 void	  fcache_destroy(void);
+int	  fcache_publish(struct file *, const char *);
+
+void	  aio_init(void);
+struct wrbuf *
+	  aio_getbuf(void);
+void	  aio_write(struct wrbuf *, struct file *, off_t, size_t, int);
+void	  aio_drain(void);
+
+void	  coalesce_init(void);
+int	  coalesce_put(struct file *, const void *, size_t, off_t, int);
+
+ssize_t	  io_pwrite(int, const void *, size_t, off_t);
+void	  io_hole(struct file *, off_t, off_t, int);
+void	  io_countwrite(size_t);
+void	  io_copy(struct file *, off_t, off_t, size_t);
+
+struct delta *
+	  delta_new(off_t, size_t);
+void	  delta_free(struct delta *);
+void	  delta_setbasis(struct delta *, off_t);
+void	  delta_index(struct delta *);
+int	  delta_sign(int, off_t, size_t, size_t, struct rpc_blksig *,
+	    void *);
+void	  delta_scan(struct delta *, struct stream *, uint64_t,
+	    const char *, off_t, off_t, int);
+
+struct cktree *
+	  cktree_new(off_t, size_t);
+void	  cktree_free(struct cktree *);
+unsigned char *
+	  cksum_leaves(int, const char *, off_t, size_t);
+uint64_t  cksum_nnodes(uint64_t, int);
+int	  cksum_height(uint64_t);
+void	  cksum_node(const unsigned char *, uint64_t, int, uint64_t,
+	    unsigned char *);
+int	  cksum_basis(struct file *, size_t);
+void	  cksum_update(struct file *, off_t, const void *, size_t);
+void	  cksum_cache_expect(struct file *, off_t, size_t);
+void	  cksum_cache_put(struct file *, int);
+void	  cksum_cache_drop(int);
+int	  cksum_cache_skip(const char *);
+
+void	  basis_start(struct filehandle *, int, uint64_t);
+void	  basis_addsums(struct rpc_getcksum_rep *);
 
 int	  getnstreams(int);
 int	  getnprocessors(void);
 
+void	  print_stats(FILE *);
+
 __dead void
 	  usage(void);
 
 int	  push_putfile_walkcb(FTSENT *, void *);
+int	  psync_walk(const char *, int, struct walkarg *);
 
 void	  psync_chown(const char *, uid_t, gid_t, int);
 void	  psync_chmod(const char *, mode_t, int);
 void	  psync_utimes(const char *, const struct pfl_timespec *, int);
+void	  psync_fchown(int, const char *, uid_t, gid_t);
+void	  psync_fchmod(int, const char *, mode_t);
+void	  psync_futimes(int, const char *, const struct pfl_timespec *);
+void	  psync_fallocate(int, const char *, off_t);
+
+void	  zero_init(void);
+int	  zero_byname(const char *);
+void	  zero_list(FILE *);
+
+void	  digest_init(void);
+void	  digest_buf(const void *, size_t, unsigned char *);
+uint32_t  digest_mask(void);
+int	  digest_byname(const char *);
+const char *
+	  digest_byid(int);
+const char *
+	  digest_name(void);
+void	  digest_negotiate(uint32_t);
+void	  digest_list(FILE *);
+
+void	  strarena_init(struct strarena *);
+void	  strarena_destroy(struct strarena *);
+char	 *strarena_dup(struct strarena *, const char *);
+void	  strarena_release(const char *);
 
 #define stream_sendv(st, opc, iov, nio)					\
 	stream_sendxv((st), 0, (opc), (iov), (nio))
@@ -165,18 +421,27 @@ struct stream *
 	 stream_create(int, int);
 void	 stream_sendx(struct stream *, uint64_t, int, void *, size_t);
 void	 stream_sendxv(struct stream *, uint64_t, int, struct iovec *, int);
+void	 stream_sendfilev(struct stream *, int, struct iovec *, int, int,
+	    off_t, const void *, size_t);
+size_t	 stream_splicefd(struct stream *, int, off_t, size_t);
+void	*stream_recv(struct stream *, struct hdr *);
+void	 stream_recvfile(struct stream *, int, off_t);
+void	 stream_swapxbuf(struct stream *, void **, size_t *);
 
 struct filehandle *
 	 filehandle_search(uint64_t);
 
-extern struct psc_hashtbl	 fcache;
+extern int			 fcache_maxfds;
+extern psc_atomic64_t		 fcache_nreopens;
 
 extern char			 objns_path[PATH_MAX];
-extern int			 objns_depth;
+extern int			 objns_rootfd;
 
 extern volatile sig_atomic_t	 exit_from_signal;
 
 extern int			 psync_is_master;
+extern uint32_t			 psync_peer_features;
+extern uint32_t			 psync_peer_maxmsglen;
 extern psc_atomic64_t		 psync_xid;
 extern mode_t			 psync_umask;
 
@@ -191,6 +456,20 @@ extern struct psc_poolmgr	*filehandles_pool;
 
 extern struct pfl_opstat	*iostats;
 
+extern psc_atomic64_t		 stream_nmsgs;
+extern psc_atomic64_t		 stream_nsyscalls;
+extern psc_atomic64_t		 stream_nrcvmsgs;
+extern psc_atomic64_t		 stream_nrcvreads;
+
+extern int			(*zero_check)(const void *, size_t);
+
+extern psc_atomic64_t		 delta_nliteral;
+extern psc_atomic64_t		 delta_nmatched;
+extern psc_atomic64_t		 cksum_nunchanged;
+
+extern psc_atomic64_t		 io_nwrites;
+extern psc_atomic64_t		 io_nwbytes;
+
 extern struct psc_dynarray	 wkrthrs;
 extern struct psc_dynarray	 rcvthrs;
 
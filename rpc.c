@@ -61,13 +61,13 @@
 #include "psync.h"
 #include "rpc.h"
 
-#define MAX_BUFSZ	(1024 * 1024)
-
 char			 objns_path[PATH_MAX];
-int			 objns_depth = 2;
 
 volatile sig_atomic_t	 exit_from_signal;
 
+uint32_t		 psync_peer_maxmsglen = MAX_BUFSZ;
+uint32_t		 psync_peer_features;
+
 void *
 buf_get(size_t len)
 {
@@ -107,9 +107,14 @@ rpc_send_getfile(struct stream *st, uint64_t xid, const char *fn,
 	stream_sendxv(st, xid, OPC_GETFILE_REQ, iov, nitems(iov));
 }
 
+/*
+ * Send a chunk of file data.  If @srcfd is valid, the data is moved
+ * from that file by the kernel (zero-copy) and @buf only serves as the
+ * fallback source.
+ */
 void
 rpc_send_putdata(struct stream *st, uint64_t fid, off_t off,
-    const void *buf, size_t len, uint32_t flags)
+    const void *buf, size_t len, uint32_t flags, int srcfd)
 {
 	struct rpc_putdata pd;
 	struct iovec iov[2];
@@ -127,13 +132,48 @@ rpc_send_putdata(struct stream *st, uint64_t fid, off_t off,
 
 	psynclog_diag("send PUTDATA fid=%#"PRIx64" len=%zd", pd.fid,
 	    len);
-	stream_sendv(st, OPC_PUTDATA, iov, nitems(iov));
+	if (srcfd != -1)
+		stream_sendfilev(st, OPC_PUTDATA, iov, 1, srcfd, off,
+		    buf, len);
+	else
+		stream_sendv(st, OPC_PUTDATA, iov, nitems(iov));
+}
+
+/*
+ * Tell the receiver a range of a file holds no data.  It counts as a
+ * chunk, and as the last one it sets the size of the file.
+ */
+void
+rpc_send_puthole(struct stream *st, uint64_t fid, off_t off,
+    uint64_t len, uint32_t flags)
+{
+	rpc_send_putdata(st, fid, off, &len, sizeof(len),
+	    flags | RPC_PUTDATA_F_HOLE, -1);
+}
+
+/* fill in the attributes of a file as they go over the wire */
+void
+rpc_pack_stat(struct rpc_sub_stat *pstb, const struct stat *stb)
+{
+	memset(pstb, 0, sizeof(*pstb));
+	pstb->dev = stb->st_dev;
+	pstb->rdev = stb->st_rdev;
+	pstb->mode = stb->st_mode;
+	pstb->uid = stb->st_uid;
+	pstb->gid = stb->st_gid;
+	pstb->size = stb->st_size;
+	PFL_STB_ATIME_GET(stb, &pstb->atim.tv_sec, &pstb->atim.tv_nsec);
+	PFL_STB_MTIME_GET(stb, &pstb->mtim.tv_sec, &pstb->mtim.tv_nsec);
 }
 
+/*
+ * Send the name and attributes of a file.  @buf carries the target of a
+ * symbolic link or, for RPC_PUTNAME_F_INLINE, the entire file contents.
+ */
 void
 rpc_send_putname_req(struct stream *st, uint64_t fid, const char *fn,
-    const struct stat *stb, const char *buf, uint64_t nchunks,
-    int rflags)
+    const struct rpc_sub_stat *pstb, const void *buf, size_t buflen,
+    uint64_t nchunks, int rflags)
 {
 	struct rpc_putname_req pn;
 	struct iovec iov[3];
@@ -143,16 +183,7 @@ rpc_send_putname_req(struct stream *st, uint64_t fid, const char *fn,
 	pn.flags = rflags;
 	pn.nchunks = nchunks;
 	pn.fid = fid;
-	pn.pstb.dev = stb->st_dev;
-	pn.pstb.rdev = stb->st_rdev;
-	pn.pstb.mode = stb->st_mode;
-	pn.pstb.uid = stb->st_uid;
-	pn.pstb.gid = stb->st_gid;
-	pn.pstb.size = stb->st_size;
-	PFL_STB_ATIME_GET(stb, &pn.pstb.atim.tv_sec,
-	    &pn.pstb.atim.tv_nsec);
-	PFL_STB_MTIME_GET(stb, &pn.pstb.mtim.tv_sec,
-	    &pn.pstb.mtim.tv_nsec);
+	pn.pstb = *pstb;
 
 	iov[nio].iov_base = &pn;
 	iov[nio].iov_len = sizeof(pn);
@@ -164,7 +195,7 @@ rpc_send_putname_req(struct stream *st, uint64_t fid, const char *fn,
 
 	if (buf) {
 		iov[nio].iov_base = (void *)buf;
-		iov[nio].iov_len = strlen(buf) + 1;
+		iov[nio].iov_len = buflen;
 		nio++;
 	}
 
@@ -172,15 +203,152 @@ rpc_send_putname_req(struct stream *st, uint64_t fid, const char *fn,
 }
 
 void
-rpc_send_putname_rep(struct stream *st, uint64_t fid, int rc)
+rpc_send_putname_rep(struct stream *st, uint64_t fid, int rc,
+    uint64_t basesize)
 {
 	struct rpc_putname_rep pnp;
 
+	memset(&pnp, 0, sizeof(pnp));
 	pnp.fid = fid;
 	pnp.rc = rc;
+	pnp.basesize = basesize;
 	stream_send(st, OPC_PUTNAME_REP, &pnp, sizeof(pnp));
 }
 
+/*
+ * Ask for the signatures of the blocks of [@off, @off + @len) of the
+ * basis of a file, or the nodes of its digest tree over that range.
+ */
+void
+rpc_send_getcksum_req(struct stream *st, uint64_t fid, off_t off,
+    size_t len, size_t blksz, int flags, int level)
+{
+	struct rpc_getcksum_req gcq;
+
+	memset(&gcq, 0, sizeof(gcq));
+	gcq.fid = fid;
+	gcq.off = off;
+	gcq.len = len;
+	gcq.blksz = blksz;
+	gcq.flags = flags;
+	gcq.level = level;
+	stream_send(st, OPC_GETCKSUM_REQ, &gcq, sizeof(gcq));
+}
+
+void
+rpc_send_getcksumv_req(struct stream *st, struct rpc_getcksum_req *gcqs,
+    int n)
+{
+	struct rpc_getcksumv_req gvq;
+	struct iovec iov[2];
+
+	memset(&gvq, 0, sizeof(gvq));
+	gvq.nreqs = n;
+
+	iov[0].iov_base = &gvq;
+	iov[0].iov_len = sizeof(gvq);
+
+	iov[1].iov_base = gcqs;
+	iov[1].iov_len = n * sizeof(*gcqs);
+
+	psynclog_diag("send GETCKSUMV_REQ nreqs=%d", n);
+	stream_sendv(st, OPC_GETCKSUMV_REQ, iov, nitems(iov));
+}
+
+/*
+ * Have the receiver fill a range of a file from its delta basis.  This
+ * counts as a chunk like any other PUTDATA.
+ */
+void
+rpc_send_putcopy(struct stream *st, uint64_t fid, off_t off,
+    off_t srcoff, size_t len)
+{
+	struct rpc_putcopy pc;
+
+	pc.srcoff = srcoff;
+	pc.len = len;
+	rpc_send_putdata(st, fid, off, &pc, sizeof(pc),
+	    RPC_PUTDATA_F_COPY, -1);
+}
+
+/*
+ * The number of chunks of a delta transfer is only known once the file
+ * has been scanned so it is sent last, on any stream.
+ */
+void
+rpc_send_puteof(struct stream *st, uint64_t fid, uint64_t nchunks,
+    off_t size, int flags)
+{
+	struct rpc_puteof pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.fid = fid;
+	pe.nchunks = nchunks;
+	pe.size = size;
+	pe.flags = flags;
+	stream_send(st, OPC_PUTEOF, &pe, sizeof(pe));
+}
+
+void
+rpc_putnames_init(struct rpc_putnames_batch *b, void *buf, size_t bufsz)
+{
+	b->pb_buf = buf;
+	b->pb_bufsz = bufsz;
+	b->pb_len = sizeof(struct rpc_putnames_req);
+	b->pb_nents = 0;
+}
+
+/*
+ * Append a PUTNAME request to a batch.  Returns zero if it does not
+ * fit, in which case the batch is left unchanged.
+ */
+int
+rpc_putnames_add(struct rpc_putnames_batch *b, uint64_t fid,
+    const char *fn, const struct rpc_sub_stat *pstb, const void *buf,
+    size_t buflen, uint64_t nchunks, int rflags)
+{
+	struct rpc_putnames_ent *pe;
+	struct rpc_putname_req *pn;
+	size_t fnlen, len;
+	char *p;
+
+	fnlen = strlen(fn) + 1;
+	len = sizeof(*pn) + fnlen + (buf ? buflen : 0);
+	if (b->pb_nents >= PUTNAMES_MAXENTS ||
+	    b->pb_len + sizeof(*pe) + RPC_ALIGN(len) > b->pb_bufsz)
+		return (0);
+
+	pe = (void *)(b->pb_buf + b->pb_len);
+	memset(pe, 0, sizeof(*pe) + sizeof(*pn));
+	pe->len = len;
+
+	pn = (void *)(pe + 1);
+	pn->pstb = *pstb;
+	pn->fid = fid;
+	pn->flags = rflags;
+	pn->nchunks = nchunks;
+
+	p = pn->fn;
+	memcpy(p, fn, fnlen);
+	p += fnlen;
+	if (buf)
+		memcpy(p, buf, buflen);
+
+	b->pb_len += sizeof(*pe) + RPC_ALIGN(len);
+	b->pb_nents++;
+	return (1);
+}
+
+void
+rpc_send_putnames_req(struct stream *st, struct rpc_putnames_batch *b)
+{
+	struct rpc_putnames_req *pnq = (void *)b->pb_buf;
+
+	memset(pnq, 0, sizeof(*pnq));
+	pnq->nents = b->pb_nents;
+	stream_send(st, OPC_PUTNAMES_REQ, b->pb_buf, b->pb_len);
+}
+
 void
 rpc_send_done(struct stream *st)
 {
@@ -192,8 +360,15 @@ rpc_send_ready(struct stream *st)
 {
 	struct rpc_ready r;
 
-	r.nstreams = opts.streams = getnstreams(
-	    MIN(getnprocessors(), opts.streams));
+	if (!psync_is_master)
+		opts.streams = getnstreams(MIN(getnprocessors(),
+		    opts.streams));
+	r.nstreams = opts.streams;
+	r.maxmsglen = MAX_BUFSZ;
+	r.features = RPC_READY_F_PUTNAMES | RPC_READY_F_DELTA |
+	    RPC_READY_F_CKTREE | RPC_READY_F_GETCKSUMV |
+	    RPC_READY_F_KEEPBASIS;
+	r.digests = digest_mask();
 	stream_send(st, OPC_READY, &r, sizeof(r));
 }
 
@@ -210,6 +385,7 @@ rpc_handle_getfile_req(struct stream *st, __unusedx struct hdr *h,
 {
 	struct rpc_getfile_req *gfq = buf;
 	struct rpc_getfile_rep gfp;
+	struct strarena arena;
 	struct walkarg wa;
 	struct stat stb;
 	int travflags;
@@ -247,9 +423,11 @@ rpc_handle_getfile_req(struct stream *st, __unusedx struct hdr *h,
 			wa.prefix = base;
 		}
 		wa.rflags = 0;
+		wa.arena = &arena;
 
-		gfp.rc = pfl_filewalk(gfq->fn, travflags, NULL,
-		    push_putfile_walkcb, &wa);
+		strarena_init(&arena);
+		gfp.rc = psync_walk(gfq->fn, travflags, &wa);
+		strarena_destroy(&arena);
 	} else {
 		gfp.rc = errno;
 	}
@@ -270,22 +448,28 @@ rpc_handle_getfile_rep(struct stream *st, struct hdr *h, void *buf)
 }
 
 void
-rpc_handle_putdata(__unusedx struct stream *st, struct hdr *h,
-    void *buf)
+rpc_handle_putdata(struct stream *st, struct hdr *h, void *buf)
 {
 	struct rpc_putdata *pd = buf;
 	struct psc_thread *thr;
 	struct rcvthr *rcvthr;
+	struct wrbuf *wb;
 	struct file *f;
+	uint64_t fid, off;
+	uint32_t flags;
 	ssize_t rc;
 	size_t len;
 
 	thr = pscthr_get();
 	rcvthr = thr->pscthr_private;
 
-	len = h->msglen - sizeof(*pd);
+	/* with --splice, the tail of large chunks is still in the stream */
+	len = h->msglen - sizeof(*pd) - st->rleft;
+	fid = pd->fid;
+	off = pd->off;
+	flags = pd->flags;
 
-	psynclog_diag("handle PUTDATA fid=%#"PRIx64, pd->fid);
+	psynclog_diag("handle PUTDATA fid=%#"PRIx64, fid);
 
 	/*
 	 * Optimization: there's a good chance this work unit is a later
@@ -293,19 +477,68 @@ rpc_handle_putdata(__unusedx struct stream *st, struct hdr *h,
 	 * track the last file and use if appropriate instead of always
 	 * searching anew.
 	 */
-	if (rcvthr->last_f && pd->fid == rcvthr->last_f->fid)
+	if (rcvthr->last_f && fid == rcvthr->last_f->fid)
 		f = rcvthr->last_f;
 	else
-		f = fcache_search(pd->fid);
-	rc = pwrite(f->fd, pd->data, len, pd->off);
-	if (rc != (ssize_t)len)
-		psynclog_error("write off=%"PRId64" len=%zd "
-		    "rc=%zd", pd->off, len, rc);
-	spinlock(&f->lock);
-	f->nchunks_seen++;
-	if (pd->flags & RPC_PUTDATA_F_LAST)
-		f->flags |= FF_SAWLAST;
-	freelock(&f->lock);
+		f = fcache_search(fid);
+
+	if ((flags & (RPC_PUTDATA_F_HOLE | RPC_PUTDATA_F_COPY)) == 0)
+		cksum_update(f, off, st->rleft ? NULL : pd->data,
+		    len + st->rleft);
+
+	if (flags & RPC_PUTDATA_F_HOLE) {
+		uint64_t hlen;
+
+		if (len != sizeof(hlen))
+			psync_fatalx("invalid hole length from peer");
+		memcpy(&hlen, pd->data, sizeof(hlen));
+		cksum_update(f, off, NULL, hlen);
+		io_hole(f, off, hlen, flags & RPC_PUTDATA_F_LAST);
+	} else if (flags & RPC_PUTDATA_F_COPY) {
+		struct rpc_putcopy pc;
+
+		if (len != sizeof(pc))
+			psync_fatalx("invalid copy length from peer");
+		memcpy(&pc, pd->data, sizeof(pc));
+		/* the cached digests start out as those of the basis */
+		if (pc.srcoff != off)
+			cksum_update(f, off, NULL, pc.len);
+		io_copy(f, off, pc.srcoff, pc.len);
+	} else if (opts.coalesce && st->rleft == 0 &&
+	    coalesce_put(f, pd->data, len, off, flags & RPC_PUTDATA_F_LAST)) {
+		/* held back to be written along with adjacent chunks */
+	} else if (opts.async_writes && st->rleft == 0) {
+		/*
+		 * Hand the chunk off so the stream keeps draining while
+		 * it is written.  A body read out of line is traded for
+		 * the buffer instead of being copied.
+		 */
+		wb = aio_getbuf();
+		if (buf == st->xbuf) {
+			stream_swapxbuf(st, &wb->wb_buf, &wb->wb_bufsz);
+			wb->wb_data = (char *)wb->wb_buf + sizeof(*pd);
+		} else {
+			if (wb->wb_bufsz < len) {
+				wb->wb_buf = psc_realloc(wb->wb_buf, len, 0);
+				wb->wb_bufsz = len;
+			}
+			memcpy(wb->wb_buf, pd->data, len);
+			wb->wb_data = wb->wb_buf;
+		}
+		aio_write(wb, f, off, len, flags & RPC_PUTDATA_F_LAST);
+	} else {
+		rc = io_pwrite(f->fd, pd->data, len, off);
+		if (rc != (ssize_t)len)
+			psynclog_error("write off=%"PRId64" len=%zd "
+			    "rc=%zd", off, len, rc);
+		if (st->rleft)
+			stream_recvfile(st, f->fd, off + len);
+		spinlock(&f->lock);
+		f->nchunks_seen++;
+		if (flags & RPC_PUTDATA_F_LAST)
+			f->flags |= FF_SAWLAST;
+		freelock(&f->lock);
+	}
 
 	/*
 	 * As each thread still processes files in a serial fashion
@@ -313,7 +546,7 @@ rpc_handle_putdata(__unusedx struct stream *st, struct hdr *h,
 	 * threads), whenever a `new' file is encountered, this thread
 	 * is done with the old one, so drop our reference.
 	 */
-	if (rcvthr->last_f && pd->fid != rcvthr->last_f->fid)
+	if (rcvthr->last_f && fid != rcvthr->last_f->fid)
 		fcache_close(rcvthr->last_f);
 	rcvthr->last_f = f;
 }
@@ -335,7 +568,7 @@ rpc_handle_checkzero_req(struct stream *st, struct hdr *h, void *buf)
 		err(1, "read");
 	if ((uint64_t)rc != czq->len)
 		warnx("read: short I/O");
-	czp.rc = pfl_memchk(bp->buf, 0, rc);
+	czp.rc = zero_check(bp->buf, rc);
 
 	buf_release(bp);
 
@@ -352,46 +585,223 @@ rpc_handle_checkzero_rep(struct stream *st, struct hdr *h, void *buf)
 	(void)czp;
 }
 
-void
-rpc_handle_getcksum_req(struct stream *st, struct hdr *h, void *buf)
+/*
+ * Compute the nodes of height @gcq->level, each covering @span bytes,
+ * of the digest tree over the basis of a file.  Returns zero or an
+ * errno.
+ */
+int
+rpc_getcksum_tree(struct file *f, struct rpc_getcksum_req *gcq,
+    struct rpc_getcksum_rep *gcp, uint64_t span, size_t nnodes)
+{
+	uint64_t first;
+	size_t i;
+	int rc;
+
+	rc = cksum_basis(f, gcq->blksz);
+	if (rc)
+		return (rc);
+
+	first = gcq->off / span;
+	if (gcq->off % span ||
+	    first + nnodes > cksum_nnodes(f->ck_nleaves, gcq->level))
+		/* basis changed size since it was opened */
+		return (EIO);
+	for (i = 0; i < nnodes; i++)
+		cksum_node(f->ck_leaves, f->ck_nleaves, gcq->level,
+		    first + i, gcp->sigs[i].strong);
+	return (0);
+}
+
+/*
+ * Check a GETCKSUM request from the peer and return the length of its
+ * reply.  @spanp is set to the bytes covered by each signature.
+ */
+size_t
+rpc_getcksum_replen(struct rpc_getcksum_req *gcq, uint64_t *spanp)
+{
+	uint64_t span;
+	size_t replen;
+	int i;
+
+	if (gcq->flags & RPC_GETCKSUM_F_TREE) {
+		if (gcq->blksz == 0 || gcq->level > CKTREE_MAXHEIGHT)
+			psync_fatalx("invalid GETCKSUM tree from peer");
+		for (span = gcq->blksz, i = 0; i < gcq->level; i++) {
+			if (span > UINT64_MAX / CKTREE_FANOUT)
+				psync_fatalx("invalid GETCKSUM tree from "
+				    "peer");
+			span *= CKTREE_FANOUT;
+		}
+	} else {
+		if (gcq->blksz == 0 || gcq->blksz > DELTA_MAXBLKSZ)
+			psync_fatalx("invalid GETCKSUM block size from "
+			    "peer");
+		span = gcq->blksz;
+	}
+	if (gcq->len > UINT64_MAX - span || howmany(gcq->len, span) >
+	    (MAX_BUFSZ - sizeof(struct rpc_getcksum_rep)) /
+	    sizeof(struct rpc_blksig))
+		psync_fatalx("invalid GETCKSUM length from peer");
+	replen = sizeof(struct rpc_getcksum_rep) +
+	    howmany(gcq->len, span) * sizeof(struct rpc_blksig);
+	*spanp = span;
+	return (replen);
+}
+
+/*
+ * Sign blocks of the basis of a file, or with RPC_GETCKSUM_F_TREE,
+ * compute nodes of its digest tree, into @gcp.  Blocks are read one at
+ * a time into @bp, which holds at least @gcq->blksz.  Returns the
+ * length of the reply, which on failure carries only the error so the
+ * peer can fall back to sending the whole range.
+ */
+size_t
+rpc_getcksum(struct rpc_getcksum_req *gcq, struct rpc_getcksum_rep *gcp,
+    uint64_t span, struct buf *bp)
 {
-	gcry_md_hd_t hd;
-	gcry_error_t gerr;
-	struct rpc_getcksum_req *gcq = buf;
-	struct rpc_getcksum_rep gcp;
-	struct buf *bp;
 	struct file *f;
-	ssize_t rc;
+	size_t nblks;
+	int rc;
 
-	bp = buf_get(gcq->len);
+	nblks = howmany(gcq->len, span);
+	memset(gcp, 0, sizeof(*gcp));
+	gcp->fid = gcq->fid;
+	gcp->off = gcq->off;
+	gcp->level = gcq->level;
 
 	f = fcache_search(gcq->fid);
-	rc = pread(f->fd, bp->buf, gcq->len, gcq->off);
-	if (rc == -1)
-		err(1, "read");
-	if ((uint64_t)rc != gcq->len)
-		warnx("read: short I/O");
+	if (f->basefd == -1)
+		rc = ENOENT;
+	else if (gcq->flags & RPC_GETCKSUM_F_TREE)
+		rc = rpc_getcksum_tree(f, gcq, gcp, span, nblks);
+	else {
+		rc = delta_sign(f->basefd, gcq->off, gcq->len, gcq->blksz,
+		    gcp->sigs, bp->buf);
+		rc = rc == -1 ? errno : 0;
+	}
+	fcache_close(f);
 
-	gerr = gcry_md_open(&hd, GCRY_MD_SHA256, 0);
-	if (gerr)
-		psync_fatalx("gcry_md_open: error=%d", gerr);
-	gcry_md_write(hd, bp->buf, rc);
-	memcpy(gcry_md_read(hd, 0), gcp.digest, ALGLEN);
-	gcry_md_close(hd);
+	gcp->rc = rc;
+	if (rc) {
+		psynclog_warnx("basis fid=%#"PRIx64": %s", gcq->fid,
+		    strerror(rc));
+		return (sizeof(*gcp));
+	}
+	gcp->nblks = nblks;
+	return (sizeof(*gcp) + nblks * sizeof(gcp->sigs[0]));
+}
 
-	buf_release(bp);
+/*
+ * A reply is always sent so the peer can fall back to sending the
+ * whole file.
+ */
+void
+rpc_handle_getcksum_req(struct stream *st, struct hdr *h, void *buf)
+{
+	struct rpc_getcksum_req *gcq = buf;
+	struct rpc_getcksum_rep *gcp;
+	struct buf *bp;
+	size_t replen;
+	uint64_t span;
+
+	psynclog_diag("handle GETCKSUM_REQ fid=%#"PRIx64" off=%"PRId64" "
+	    "len=%"PRId64" flags=%#x", gcq->fid, gcq->off, gcq->len,
+	    gcq->flags);
 
-	stream_sendx(st, h->xid, OPC_GETCKSUM_REP, &gcp, sizeof(gcp));
+	replen = rpc_getcksum_replen(gcq, &span);
+	gcp = PSCALLOC(replen);
+	bp = buf_get(gcq->flags & RPC_GETCKSUM_F_TREE ? 0 : gcq->blksz);
+	replen = rpc_getcksum(gcq, gcp, span, bp);
+	buf_release(bp);
+	stream_sendx(st, h->xid, OPC_GETCKSUM_REP, gcp, replen);
+	PSCFREE(gcp);
 }
 
 void
-rpc_handle_getcksum_rep(struct stream *st, struct hdr *h, void *buf)
+rpc_handle_getcksum_rep(__unusedx struct stream *st, struct hdr *h,
+    void *buf)
 {
 	struct rpc_getcksum_rep *gcp = buf;
 
-	(void)st;
-	(void)h;
-	(void)gcp;
+	if (h->msglen < sizeof(*gcp) || gcp->nblks >
+	    (h->msglen - sizeof(*gcp)) / sizeof(gcp->sigs[0]))
+		psync_fatalx("malformed GETCKSUM_REP from peer");
+	basis_addsums(gcp);
+}
+
+/*
+ * Answer a batch of GETCKSUM requests in one reply.  The ranges are
+ * hashed in turn through the same block buffer; the reply, whose size
+ * the sender kept within MAX_BUFSZ, is the only other allocation.
+ */
+void
+rpc_handle_getcksumv_req(struct stream *st, struct hdr *h, void *buf)
+{
+	struct rpc_getcksumv_req *gvq = buf;
+	struct rpc_getcksumv_rep *gvp;
+	struct rpc_getcksum_rep *gcp;
+	size_t len, replen, blksz = 0;
+	struct buf *bp;
+	uint64_t span;
+	uint32_t i;
+	char *p;
+
+	if (h->msglen < sizeof(*gvq) || gvq->nreqs >
+	    (h->msglen - sizeof(*gvq)) / sizeof(gvq->reqs[0]))
+		psync_fatalx("malformed GETCKSUMV_REQ from peer");
+
+	psynclog_diag("handle GETCKSUMV_REQ nreqs=%u", gvq->nreqs);
+
+	replen = sizeof(*gvp);
+	for (i = 0; i < gvq->nreqs; i++) {
+		replen += RPC_ALIGN(rpc_getcksum_replen(&gvq->reqs[i],
+		    &span));
+		if (replen > MAX_BUFSZ)
+			psync_fatalx("invalid GETCKSUMV length from peer");
+		if ((gvq->reqs[i].flags & RPC_GETCKSUM_F_TREE) == 0)
+			blksz = MAX(blksz, gvq->reqs[i].blksz);
+	}
+
+	gvp = PSCALLOC(replen);
+	gvp->nreps = gvq->nreqs;
+	p = (char *)(gvp + 1);
+	bp = buf_get(blksz);
+	for (i = 0; i < gvq->nreqs; i++) {
+		rpc_getcksum_replen(&gvq->reqs[i], &span);
+		gcp = (void *)p;
+		len = rpc_getcksum(&gvq->reqs[i], gcp, span, bp);
+		p += RPC_ALIGN(len);
+	}
+	buf_release(bp);
+	stream_sendx(st, h->xid, OPC_GETCKSUMV_REP, gvp, p - (char *)gvp);
+	PSCFREE(gvp);
+}
+
+void
+rpc_handle_getcksumv_rep(__unusedx struct stream *st, struct hdr *h,
+    void *buf)
+{
+	struct rpc_getcksumv_rep *gvp = buf;
+	struct rpc_getcksum_rep *gcp;
+	char *p, *end;
+	uint32_t i;
+
+	if (h->msglen < sizeof(*gvp))
+		psync_fatalx("malformed GETCKSUMV_REP from peer");
+	p = (char *)(gvp + 1);
+	end = (char *)buf + h->msglen;
+	for (i = 0; i < gvp->nreps; i++) {
+		gcp = (void *)p;
+		/* the padding of the previous reply may overshoot */
+		if (p > end || (size_t)(end - p) < sizeof(*gcp) ||
+		    gcp->nblks > ((size_t)(end - p) - sizeof(*gcp)) /
+		    sizeof(gcp->sigs[0]))
+			psync_fatalx("malformed GETCKSUMV_REP from peer");
+		basis_addsums(gcp);
+		p += RPC_ALIGN(sizeof(*gcp) + gcp->nblks *
+		    sizeof(gcp->sigs[0]));
+	}
 }
 
 /*
@@ -453,20 +863,26 @@ userfn_subst(const char *fn)
 	return (rcvthr->fnbuf);
 }
 
+/*
+ * Create a name received in a PUTNAME request of @len bytes.  The
+ * existence of the parent directory is only ensured if @chkparent is
+ * set; batches do so once for all their entries.
+ */
 void
-rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
+rpc_putname_apply(struct stream *st, uint64_t xid,
+    struct rpc_putname_req *pn, size_t len, int chkparent)
 {
-	char *sep, *ufn, objfn[PATH_MAX];
-	struct rpc_putname_req *pn = buf;
-	int rc = 0, fd = -1, flags = 0;
+	char *sep, *ufn, objfn[OBJNS_BASENAMELEN];
+	int rc = 0, fd = -1, flags = 0, inl = 0, basefd = -1, stashed = 0;
 	struct file *f = NULL;
+	uint64_t basesize = 0;
 	mode_t mode;
 
 	/* apply incoming name substitutions */
 	ufn = userfn_subst(pn->fn);
 	psynclog_diag("handle PUTNAME_REQ xid=%#"PRIx64" %s -> %s "
 	    "mode=%0o flags=%d",
-	    h->xid, pn->fn, ufn, pn->pstb.mode, pn->flags);
+	    xid, pn->fn, ufn, pn->pstb.mode, pn->flags);
 
 	if (pn->flags & RPC_PUTNAME_F_TRYDIR) {
 		struct stat stb;
@@ -476,7 +892,7 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 			*sep = '\0';
 		if (stat(ufn, &stb) == 0 && S_ISDIR(stb.st_mode))
 			*sep = '/';
-	} else {
+	} else if (chkparent) {
 		/*
 		 * We might race with other threads so ensure the
 		 * directory hierarchy is intact.
@@ -490,6 +906,26 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 		}
 	}
 
+	if (pn->flags & RPC_PUTNAME_F_BASIS && S_ISREG(pn->pstb.mode)) {
+		struct stat stb;
+
+		/*
+		 * Hold on to the current version of the file as the
+		 * basis to compare against before the name is replaced.
+		 */
+		basefd = open(ufn, O_RDONLY);
+		if (basefd != -1 && (fstat(basefd, &stb) == -1 ||
+		    !S_ISREG(stb.st_mode) || stb.st_size == 0)) {
+			close(basefd);
+			basefd = -1;
+		} else if (basefd != -1) {
+			basesize = stb.st_size;
+			/* to be put back if --checksum finds it unchanged */
+			stashed = opts.checksum &&
+			    objns_stashbasis(pn->fid, ufn) == 0;
+		}
+	}
+
 	if (S_ISCHR(pn->pstb.mode) ||
 	    S_ISBLK(pn->pstb.mode)) {
 		if (mknod(ufn, pn->pstb.mode, pn->pstb.rdev) == -1) {
@@ -538,10 +974,51 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 		}
 		close(fd);
 		fd = -1;
+	} else if (S_ISREG(pn->pstb.mode) &&
+	    pn->flags & RPC_PUTNAME_F_INLINE) {
+		const char *data, *end;
+		ssize_t datalen;
+
+		/*
+		 * The file contents are packed after the FS path so the
+		 * file can be written out without involving the fcache.
+		 * It is renamed over its name once complete.
+		 */
+		end = (const char *)pn + len;
+		data = len < sizeof(*pn) ? NULL :
+		    memchr(pn->fn, '\0', end - pn->fn);
+		if (data == NULL)
+			psync_fatalx("malformed PUTNAME_REQ from peer");
+		data++;
+		datalen = end - data;
+
+		fd = objns_inline(pn->fid, objfn);
+		if (fd == -1) {
+			psynclog_warn("objns open %s", ufn);
+			return;
+		}
+		if (datalen && pwrite(fd, data, datalen, 0) != datalen)
+			psynclog_error("write %s len=%zd", ufn, datalen);
+		inl = 1;
+	} else if (S_ISREG(pn->pstb.mode) && objns_usetmpfile()) {
+		/*
+		 * The data lands in an anonymous file which only now
+		 * gets a name; there is no object namespace entry to
+		 * link from or clean up.
+		 */
+		f = fcache_search(pn->fid);
+		unlink(ufn);
+		if (fcache_publish(f, ufn) == -1) {
+			rc = errno;
+			psynclog_warn("link %s", ufn);
+			fcache_close(f);
+			goto out;
+		}
 	} else if (S_ISREG(pn->pstb.mode)) {
 		struct stat dummy;
+		int dfd;
 
-		objns_makepath(objfn, pn->fid);
+		dfd = objns_lookup(pn->fid, objfn);
 
 		if (opts.partial && stat(ufn, &dummy) == 0) {
 			/*
@@ -550,13 +1027,13 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 			 * response to this RPC before sending file data
 			 * when in --partial mode.
 			 */
-			if (link(ufn, objfn) == -1) {
+			if (linkat(AT_FDCWD, ufn, dfd, objfn, 0) == -1) {
 				psynclog_warn("open %s", ufn);
 				goto out;
 			}
-			fd = open(objfn, O_RDWR);
+			fd = openat(dfd, objfn, O_RDWR);
 		} else
-			fd = open(objfn, O_CREAT | O_RDWR, 0600);
+			fd = openat(dfd, objfn, O_CREAT | O_RDWR, 0600);
 		if (fd == -1) {
 			rc = errno;
 			psynclog_warn("objns open %s", ufn);
@@ -566,7 +1043,7 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 		if (!opts.partial)
 			unlink(ufn);
 
-		if (link(objfn, ufn) == -1) {
+		if (linkat(dfd, objfn, AT_FDCWD, ufn, 0) == -1) {
 			rc = errno;
 			close(fd);
 			psynclog_warn("link %s -> %s", ufn, objfn);
@@ -577,12 +1054,21 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 		return;
 	}
 
+	if (opts.preallocate && !inl && S_ISREG(pn->pstb.mode))
+		psync_fallocate(f ? f->fd : fd, ufn, pn->pstb.size);
+
 	if (opts.owner || opts.group) {
 		if (!opts.owner)
 			pn->pstb.uid = -1;
 		if (!opts.group)
 			pn->pstb.gid = -1;
-		psync_chown(ufn, pn->pstb.uid, pn->pstb.gid, flags);
+		if (fd != -1 || f)
+			/* regular files are open here one way or another */
+			psync_fchown(fd != -1 ? fd : f->fd, ufn,
+			    pn->pstb.uid, pn->pstb.gid);
+		else
+			psync_chown(ufn, pn->pstb.uid, pn->pstb.gid,
+			    flags);
 	}
 
 	/*
@@ -596,7 +1082,9 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 		mode = pn->pstb.mode;
 	else if (opts.executability)
 		mode |= pn->pstb.mode & _S_IXUGO;
-	if (S_ISREG(pn->pstb.mode) || S_ISDIR(pn->pstb.mode)) {
+	if (inl) {
+		psync_fchmod(fd, ufn, mode);
+	} else if (S_ISREG(pn->pstb.mode) || S_ISDIR(pn->pstb.mode)) {
 		if (f == NULL)
 			f = fcache_search(pn->fid);
 
@@ -613,7 +1101,9 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 		psync_chmod(ufn, mode, flags);
 
 	if (opts.times) {
-		if (S_ISREG(pn->pstb.mode)) {
+		if (inl) {
+			psync_futimes(fd, ufn, pn->pstb.tim);
+		} else if (S_ISREG(pn->pstb.mode)) {
 			/*
 			 * Subsequent writes will repeatedly update
 			 * mtime so save the intended times and set
@@ -626,6 +1116,16 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 			psync_utimes(ufn, pn->pstb.tim, flags);
 	}
 
+	if (f && S_ISREG(pn->pstb.mode))
+		cksum_cache_expect(f, pn->pstb.size, pn->pstb.blksize);
+
+	if (basefd != -1) {
+		if (f == NULL)
+			f = fcache_search(pn->fid);
+		fcache_setbasis(f, basefd, stashed ? ufn : NULL);
+		basefd = -1;
+	}
+
 	if (f) {
 		spinlock(&f->lock);
 		f->nchunks = pn->nchunks;
@@ -644,14 +1144,54 @@ rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
 	/* XXX linux file attributes: FS_IOC_GETFLAGS */
 	/* XXX extattr */
 
+	if (inl && renameat(objns_rootfd, objfn, AT_FDCWD, ufn) == -1) {
+		psynclog_warn("rename %s", ufn);
+		unlinkat(objns_rootfd, objfn, 0);
+	}
 	if (fd != -1)
 		close(fd);
 	if (f)
 		fcache_close(f);
 
  out:
-	if (opts.partial)
-		rpc_send_putname_rep(st, pn->fid, rc);
+	if (basefd != -1) {
+		close(basefd);
+		basesize = 0;
+	}
+	if (opts.partial || pn->flags & RPC_PUTNAME_F_BASIS)
+		rpc_send_putname_rep(st, pn->fid, rc, basesize);
+}
+
+void
+rpc_handle_putname_req(struct stream *st, struct hdr *h, void *buf)
+{
+	rpc_putname_apply(st, h->xid, buf, h->msglen, 1);
+}
+
+void
+rpc_handle_putnames_req(struct stream *st, struct hdr *h, void *buf)
+{
+	struct rpc_putnames_req *pnq = buf;
+	struct rpc_putnames_ent *pe;
+	char *p, *end;
+	uint32_t i;
+
+	psynclog_diag("handle PUTNAMES_REQ xid=%#"PRIx64" nents=%u",
+	    h->xid, pnq->nents);
+
+	p = (char *)(pnq + 1);
+	end = (char *)buf + h->msglen;
+	for (i = 0; i < pnq->nents; i++) {
+		pe = (void *)p;
+		/* the padding of the previous entry may overshoot */
+		if (p > end || (size_t)(end - p) < sizeof(*pe) ||
+		    pe->len < sizeof(struct rpc_putname_req) ||
+		    pe->len > (size_t)(end - p) - sizeof(*pe))
+			psync_fatalx("malformed PUTNAMES_REQ from peer");
+		rpc_putname_apply(st, h->xid, (void *)(pe + 1), pe->len,
+		    i == 0);
+		p += sizeof(*pe) + RPC_ALIGN(pe->len);
+	}
 }
 
 void
@@ -662,10 +1202,41 @@ rpc_handle_putname_rep(__unusedx struct stream *st,
 	struct filehandle *fh;
 
 	fh = filehandle_search(pnp->fid);
-	if (fh)
+	if (fh && (fh->delta || fh->cktree))
+		basis_start(fh, pnp->rc, pnp->basesize);
+	else if (fh)
 		psc_compl_ready(&fh->cmpl, pnp->rc);
 }
 
+/*
+ * All chunks of a delta transfer are out; now the file knows how many
+ * to wait for.  A --checksum file found unchanged keeps its basis.
+ */
+void
+rpc_handle_puteof(__unusedx struct stream *st, struct hdr *h, void *buf)
+{
+	struct rpc_puteof *pe = buf;
+	uint64_t nchunks;
+	struct file *f;
+
+	psynclog_diag("handle PUTEOF fid=%#"PRIx64" nchunks=%"PRIu64,
+	    pe->fid, pe->nchunks);
+
+	f = fcache_search(pe->fid);
+	if (h->msglen >= sizeof(*pe) && pe->flags & RPC_PUTEOF_F_KEEP)
+		nchunks = fcache_keepbasis(f, pe->size);
+	else {
+		nchunks = pe->nchunks;
+		if (ftruncate(f->fd, pe->size) == -1)
+			psynclog_warn("truncate fd=%d", f->fd);
+	}
+	spinlock(&f->lock);
+	f->nchunks = nchunks;
+	f->flags |= FF_SAWLAST;
+	freelock(&f->lock);
+	fcache_close(f);
+}
+
 void
 rpc_handle_done(struct stream *st, __unusedx struct hdr *h,
     __unusedx void *buf)
@@ -675,8 +1246,7 @@ rpc_handle_done(struct stream *st, __unusedx struct hdr *h,
 }
 
 void
-rpc_handle_ready(__unusedx struct stream *st, __unusedx struct hdr *h,
-    void *buf)
+rpc_handle_ready(struct stream *st, struct hdr *h, void *buf)
 {
 	struct rpc_ready *r = buf;
 
@@ -684,6 +1254,18 @@ rpc_handle_ready(__unusedx struct stream *st, __unusedx struct hdr *h,
 	if (r->nstreams > 0 &&
 	    r->nstreams < opts.streams)
 		opts.streams = r->nstreams;
+
+	/* peers predating the negotiation leave this zero */
+	psync_peer_maxmsglen = r->maxmsglen ? MIN(r->maxmsglen,
+	    MAX_BUFSZ) : LEGACY_MAX_BUFSZ;
+	if (h->msglen >= sizeof(*r)) {
+		psync_peer_features = r->features;
+		digest_negotiate(r->digests);
+	}
+
+	/* the puppet sends as well on GETs, so tell it in turn */
+	if (psync_is_master)
+		rpc_send_ready(st);
 	psc_compl_ready(&psync_ready, 1);
 }
 
@@ -700,7 +1282,11 @@ op_handler_t ops[] = {
 	rpc_handle_putname_req,
 	rpc_handle_putname_rep,
 	rpc_handle_done,
-	rpc_handle_ready
+	rpc_handle_ready,
+	rpc_handle_putnames_req,
+	rpc_handle_puteof,
+	rpc_handle_getcksumv_req,
+	rpc_handle_getcksumv_rep
 };
 
 void
@@ -713,38 +1299,24 @@ handle_signal(__unusedx int sig)
 void
 rcvthr_main(struct psc_thread *thr)
 {
-	void *buf = NULL;
-	uint32_t bufsz = 0;
 	struct rcvthr *rcvthr;
 	struct stream *st;
 	struct hdr hdr;
-	ssize_t rc;
+	void *buf;
 
 	rcvthr = thr->pscthr_private;
 	st = rcvthr->st;
 	while (pscthr_run(thr)) {
-		rc = atomicio_read(st->rfd, &hdr, sizeof(hdr));
-		if (rc == 0)
+		buf = stream_recv(st, &hdr);
+		if (buf == NULL)
 			break;
 		if (exit_from_signal)
 			break;
 
-		if (hdr.msglen > bufsz) {
-			if (hdr.msglen > MAX_BUFSZ)
-				psync_fatalx("invalid bufsz received "
-				    "from peer: %u", hdr.msglen);
-			bufsz = hdr.msglen;
-			buf = realloc(buf, bufsz);
-			if (buf == NULL)
-				err(1, NULL);
-		}
 		if (hdr.opc >= nitems(ops))
 			psync_fatalx("invalid opcode received from "
 			    "peer: %u", hdr.opc);
-		atomicio_read(st->rfd, buf, hdr.msglen);
 
-		if (exit_from_signal)
-			break;
 		ops[hdr.opc](st, &hdr, buf);
 		if (exit_from_signal || st->done)
 			break;
@@ -752,6 +1324,8 @@ rcvthr_main(struct psc_thread *thr)
 
 	psynclog_diag("rcvthr done, close fd=%d", st->rfd);
 	close(st->rfd);
+	PSCFREE(st->rbuf);
+	PSCFREE(st->xbuf);
 
 	spinlock(&rcvthrs_lock);
 	psc_dynarray_removeitem(&rcvthrs, thr);
@@ -45,6 +45,18 @@ struct hdr {
 #define OPC_PUTNAME_REP		 8
 #define OPC_DONE		 9
 #define OPC_READY		10
+#define OPC_PUTNAMES_REQ	11
+#define OPC_PUTEOF		12
+#define OPC_GETCKSUMV_REQ	13
+#define OPC_GETCKSUMV_REP	14
+
+/*
+ * Largest message a receiver accepts by default.  The effective limit is
+ * advertised to the peer in OPC_READY so senders can size their data
+ * chunks accordingly.
+ */
+#define MAX_BUFSZ		(MAX_BLKSZ + 4096)
+#define LEGACY_MAX_BUFSZ	(1024 * 1024)
 
 struct rpc_sub_stat {
 	uint64_t		dev;
@@ -52,7 +64,7 @@ struct rpc_sub_stat {
 	uint32_t		mode;
 	uint32_t		uid;
 	uint32_t		gid;
-	uint32_t		_pad;
+	uint32_t		blksize;	/* chunk size, if sent so */
 	uint64_t		size;
 	struct pfl_timespec	tim[2];
 #define atim tim[0]			/* access time */
@@ -83,6 +95,25 @@ struct rpc_putdata {
 };
 
 #define RPC_PUTDATA_F_LAST	(1 << 0)	/* this chunk is last one */
+#define RPC_PUTDATA_F_HOLE	(1 << 1)	/* data is uint64_t hole length */
+#define RPC_PUTDATA_F_COPY	(1 << 2)	/* data is rpc_putcopy */
+
+/* take a run of the delta basis file instead of data */
+struct rpc_putcopy {
+	uint64_t		srcoff;
+	uint64_t		len;
+};
+
+/* all chunks of a delta transfer have been sent */
+struct rpc_puteof {
+	uint64_t		fid;
+	uint64_t		nchunks;
+	uint64_t		size;
+	uint32_t		flags;
+	uint32_t		_pad;
+};
+
+#define RPC_PUTEOF_F_KEEP	(1 << 0)	/* basis unchanged, keep it */
 
 struct rpc_checkzero_req {
 	uint64_t		fid;
@@ -92,17 +123,58 @@ struct rpc_checkzero_req {
 
 #define rpc_checkzero_rep rpc_generic_rep
 
+/*
+ * Signatures of the blocks of @blksz bytes of a range of the basis
+ * file of @fid.  With RPC_GETCKSUM_F_TREE, @blksz is the size of the
+ * leaves of a tree of digests and the nodes of height @level are
+ * wanted instead.
+ */
 struct rpc_getcksum_req {
 	uint64_t		fid;
 	uint64_t		off;
 	uint64_t		len;
+	uint32_t		blksz;
+	uint16_t		flags;
+	uint16_t		level;
+};
+
+#define RPC_GETCKSUM_F_TREE	(1 << 0)	/* chunk digest tree nodes */
+
+#define ALGLEN 32				/* longest digest; others padded */
+
+struct rpc_blksig {
+	uint32_t		weak;		/* rolling checksum */
+	unsigned char		strong[ALGLEN];
 };
 
-#define ALGLEN 32
 struct rpc_getcksum_rep {
-	char			digest[ALGLEN];
+	uint64_t		fid;
+	uint64_t		off;
+	uint32_t		nblks;
+	 int32_t		rc;
+	uint32_t		level;		/* as requested */
+	uint32_t		_pad;
+	struct rpc_blksig	sigs[0];
+};
+
+/*
+ * A batch of GETCKSUM requests.  The reply holds a GETCKSUM_REP for
+ * each in order, padded so the next one is aligned, and must fit in
+ * MAX_BUFSZ.
+ */
+struct rpc_getcksumv_req {
+	uint32_t		nreqs;
+	uint32_t		_pad;
+	struct rpc_getcksum_req	reqs[0];
+};
+
+struct rpc_getcksumv_rep {
+	uint32_t		nreps;
+	uint32_t		_pad;
 };
 
+#define GETCKSUMV_MAXREQS	64
+
 struct rpc_putname_req {
 	struct rpc_sub_stat	pstb;
 	uint64_t		fid;
@@ -116,26 +188,93 @@ struct rpc_putname_rep {
 	uint64_t		fid;
 	 int32_t		rc;
 	 int32_t		_pad;
+	uint64_t		basesize;	/* delta basis, 0 for none */
 };
 
 #define RPC_PUTNAME_F_TRYDIR	(1 << 0)	/* try directory as base */
+#define RPC_PUTNAME_F_INLINE	(1 << 1)	/* file data follows name */
+#define RPC_PUTNAME_F_BASIS	(1 << 2)	/* existing file is compared */
+
+/*
+ * A batch of PUTNAME requests for entries of the same directory.  Each
+ * request is preceded by its length and padded so the next one is
+ * aligned.
+ */
+struct rpc_putnames_req {
+	uint32_t		nents;
+	uint32_t		_pad;
+};
+
+struct rpc_putnames_ent {
+	uint32_t		len;	/* of rpc_putname_req and trailer */
+	uint32_t		_pad;
+};
+
+#define RPC_ALIGN(n)		(((n) + 7) & ~(size_t)7)
+
+#define PUTNAMES_MAXENTS	256
+#define PUTNAMES_MAXSZ		(256 * 1024)
+
+/* a PUTNAMES message being built */
+struct rpc_putnames_batch {
+	char			*pb_buf;
+	size_t			 pb_bufsz;
+	size_t			 pb_len;
+	int			 pb_nents;
+};
 
 struct rpc_ready {
 	 int32_t		nstreams;
-	 int32_t		_pad;
+	uint32_t		maxmsglen;	/* largest message accepted */
+	uint32_t		features;
+	uint32_t		digests;	/* 1 << DIGEST_* supported */
 };
 
+#define RPC_READY_F_PUTNAMES	(1 << 0)	/* OPC_PUTNAMES_REQ understood */
+#define RPC_READY_F_DELTA	(1 << 1)	/* delta transfers understood */
+#define RPC_READY_F_CKTREE	(1 << 2)	/* RPC_GETCKSUM_F_TREE understood */
+#define RPC_READY_F_GETCKSUMV	(1 << 3)	/* OPC_GETCKSUMV_REQ understood */
+#define RPC_READY_F_KEEPBASIS	(1 << 4)	/* RPC_PUTEOF_F_KEEP understood */
+
 #define AUTH_LEN		1024
 
+/* a message waiting to be written to a stream */
+struct sendreq {
+	struct hdr		 sr_hdr;
+	struct iovec		*sr_iov;
+	int			 sr_nio;
+	int			 sr_done;
+	int			 sr_fd;		/* zero-copy source or -1 */
+	off_t			 sr_off;
+	const void		*sr_buf;	/* fallback for sr_fd */
+	size_t			 sr_len;
+	struct sendreq		*sr_next;
+};
+
+void rpc_pack_stat(struct rpc_sub_stat *, const struct stat *);
+
 void rpc_send_done(struct stream *);
 void rpc_send_ready(struct stream *);
 void rpc_send_getfile(struct stream *, uint64_t, const char *,
 	const char *);
 void rpc_send_putdata(struct stream *, uint64_t, off_t, const void *,
-	size_t, uint32_t);
+	size_t, uint32_t, int);
+void rpc_send_puthole(struct stream *, uint64_t, off_t, uint64_t,
+	uint32_t);
 void rpc_send_putname_req(struct stream *, uint64_t, const char *,
-	const struct stat *, const char *, uint64_t, int);
-void rpc_send_putname_rep(struct stream *, uint64_t, int);
+	const struct rpc_sub_stat *, const void *, size_t, uint64_t, int);
+void rpc_send_putname_rep(struct stream *, uint64_t, int, uint64_t);
+void rpc_send_getcksum_req(struct stream *, uint64_t, off_t, size_t,
+	size_t, int, int);
+void rpc_send_getcksumv_req(struct stream *, struct rpc_getcksum_req *,
+	int);
+void rpc_send_putcopy(struct stream *, uint64_t, off_t, off_t, size_t);
+void rpc_send_puteof(struct stream *, uint64_t, uint64_t, off_t, int);
+void rpc_send_putnames_req(struct stream *, struct rpc_putnames_batch *);
+
+void rpc_putnames_init(struct rpc_putnames_batch *, void *, size_t);
+int  rpc_putnames_add(struct rpc_putnames_batch *, uint64_t, const char *,
+	const struct rpc_sub_stat *, const void *, size_t, uint64_t, int);
 
 void handle_signal(int);
 
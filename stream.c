@@ -29,9 +29,15 @@
  * The streams API communicates the psync protocol over sockets.
  */
 
+#include <sys/param.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,11 +48,19 @@
 #include "pfl/random.h"
 #include "pfl/str.h"
 
+#include "options.h"
 #include "psync.h"
 #include "rpc.h"
 
 psc_atomic64_t psync_xid;
 
+psc_atomic64_t stream_nmsgs = PSC_ATOMIC64_INIT(0);
+psc_atomic64_t stream_nsyscalls = PSC_ATOMIC64_INIT(0);
+psc_atomic64_t stream_nrcvmsgs = PSC_ATOMIC64_INIT(0);
+psc_atomic64_t stream_nrcvreads = PSC_ATOMIC64_INIT(0);
+
+#define MAX_RETRY	10
+
 ssize_t
 atomicio(int op, int fd, void *buf, size_t len)
 {
@@ -67,7 +81,6 @@ atomicio(int op, int fd, void *buf, size_t len)
 				psync_fatal("%s sz=%zd",
 				    op == IOP_READ ? "read" : "write",
 				    rem);
-#define MAX_RETRY	10
 			if (++nerr > MAX_RETRY)
 				psync_fatalx("exceeded number of "
 				    "retries");
@@ -79,29 +92,456 @@ atomicio(int op, int fd, void *buf, size_t len)
 	return (rc);
 }
 
+/*
+ * Write out a vector in its entirety, resuming after partial writes.
+ */
+void
+atomicio_writev(int fd, struct iovec *iov, int nio)
+{
+	ssize_t rc;
+	int nerr = 0;
+
+	while (nio > 0) {
+		rc = writev(fd, iov, nio);
+		psc_atomic64_inc(&stream_nsyscalls);
+		if (rc == -1) {
+			if (errno != EINTR)
+				psync_fatal("writev");
+			if (++nerr > MAX_RETRY)
+				psync_fatalx("exceeded number of "
+				    "retries");
+			continue;
+		}
+		if (iostats)
+			pfl_opstat_add(iostats, rc);
+		for (; nio > 0 && (size_t)rc >= iov->iov_len; iov++, nio--)
+			rc -= iov->iov_len;
+		if (nio > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+}
+
+/*
+ * Move @len bytes of file data from @fd at @off straight into the
+ * stream without copying them through user space.  Returns the number
+ * of bytes moved, which is short if the kernel refuses the transfer so
+ * the caller may finish up by other means.
+ */
+size_t
+stream_splicefd(struct stream *st, int fd, off_t off, size_t len)
+{
+	size_t rem = len;
+	ssize_t rc = 0;
+
+	for (; rem > 0; rem -= rc) {
+#ifdef SPLICE_F_MOVE
+		if (S_ISFIFO(st->wtype))
+			rc = splice(fd, &off, st->wfd, NULL, rem,
+			    SPLICE_F_MOVE | SPLICE_F_MORE);
+		else if (S_ISSOCK(st->wtype))
+			rc = sendfile(st->wfd, fd, &off, rem);
+		else
+#endif
+		{
+			errno = ENOTSUP;
+			rc = -1;
+		}
+		psc_atomic64_inc(&stream_nsyscalls);
+		if (rc == -1 && errno == EINTR) {
+			rc = 0;
+			continue;
+		}
+		if (rc <= 0)
+			break;
+		if (iostats)
+			pfl_opstat_add(iostats, rc);
+	}
+	return (len - rem);
+}
+
+/*
+ * Write out a batch of queued messages.  Headers and payloads of all
+ * messages are gathered into as few writev(2) calls as possible; only
+ * the file data of zero-copy messages is moved separately.
+ */
+void
+stream_flush(struct stream *st, struct sendreq *sr)
+{
+	struct iovec iov[STREAM_MAXIOV];
+	size_t nb;
+	int i, nio = 0;
+
+	for (; sr; sr = sr->sr_next) {
+		if (nio + sr->sr_nio + 1 > STREAM_MAXIOV) {
+			atomicio_writev(st->wfd, iov, nio);
+			nio = 0;
+		}
+		iov[nio].iov_base = &sr->sr_hdr;
+		iov[nio].iov_len = sizeof(sr->sr_hdr);
+		nio++;
+		for (i = 0; i < sr->sr_nio; i++) {
+			if (sr->sr_iov[i].iov_len == 0)
+				continue;
+			/* a message too large to gather goes in pieces */
+			if (nio == STREAM_MAXIOV) {
+				atomicio_writev(st->wfd, iov, nio);
+				nio = 0;
+			}
+			iov[nio++] = sr->sr_iov[i];
+		}
+		psc_atomic64_inc(&stream_nmsgs);
+
+		if (sr->sr_fd == -1)
+			continue;
+
+		/* file data must follow what has been gathered so far */
+		atomicio_writev(st->wfd, iov, nio);
+		nio = 0;
+
+		nb = 0;
+		if (!st->nozerocopy) {
+			nb = stream_splicefd(st, sr->sr_fd, sr->sr_off,
+			    sr->sr_len);
+			if (nb == 0 && sr->sr_len) {
+				psynclog_diag("zero-copy unavailable on "
+				    "fd=%d: %s", st->wfd, strerror(errno));
+				st->nozerocopy = 1;
+			}
+		}
+		if (nb < sr->sr_len) {
+			iov[0].iov_base = (char *)sr->sr_buf + nb;
+			iov[0].iov_len = sr->sr_len - nb;
+			atomicio_writev(st->wfd, iov, 1);
+		}
+	}
+	if (nio)
+		atomicio_writev(st->wfd, iov, nio);
+}
+
+/*
+ * Queue a message for sending and wait until it has been written.  The
+ * first thread to find the stream idle becomes its writer and drains
+ * everything queued, including messages other threads add meanwhile;
+ * those threads sleep instead of contending for the stream so no lock
+ * is held across a blocking write.
+ */
+void
+stream_sendreq(struct stream *st, struct sendreq *sr)
+{
+	struct sendreq *batch, *t;
+
+	sr->sr_next = NULL;
+	sr->sr_done = 0;
+
+	spinlock(&st->lock);
+	*st->sendq_tailp = sr;
+	st->sendq_tailp = &sr->sr_next;
+	while (!sr->sr_done) {
+		if (st->writing) {
+			psc_waitq_wait(&st->wq, &st->lock);
+			spinlock(&st->lock);
+			continue;
+		}
+		st->writing = 1;
+		batch = st->sendq;
+		st->sendq = NULL;
+		st->sendq_tailp = &st->sendq;
+		freelock(&st->lock);
+
+		stream_flush(st, batch);
+
+		spinlock(&st->lock);
+		for (t = batch; t; t = t->sr_next)
+			t->sr_done = 1;
+		st->writing = 0;
+		psc_waitq_wakeall(&st->wq);
+	}
+	freelock(&st->lock);
+}
+
+/*
+ * Read whatever is available into the receive buffer, first moving the
+ * unparsed remainder to its start.  Returns zero at EOF.
+ */
+ssize_t
+stream_fill(struct stream *st)
+{
+	ssize_t rc;
+	int nerr = 0;
+
+	if (st->rpos) {
+		memmove(st->rbuf, st->rbuf + st->rpos, st->rlen - st->rpos);
+		st->rlen -= st->rpos;
+		st->rpos = 0;
+	}
+	for (;;) {
+		rc = read(st->rfd, st->rbuf + st->rlen,
+		    STREAM_RBUFSZ - st->rlen);
+		if (rc != -1)
+			break;
+		if (errno != EINTR)
+			psync_fatal("read sz=%zd", STREAM_RBUFSZ - st->rlen);
+		if (++nerr > MAX_RETRY)
+			psync_fatalx("exceeded number of retries");
+	}
+	psc_atomic64_inc(&stream_nrcvreads);
+	if (iostats)
+		pfl_opstat_add(iostats, rc);
+	st->rlen += rc;
+	return (rc);
+}
+
+void *
+stream_xbuf(struct stream *st, size_t len)
+{
+	if (len > st->xbufsz) {
+		st->xbuf = psc_realloc(st->xbuf, len, 0);
+		st->xbufsz = len;
+	}
+	return (st->xbuf);
+}
+
+/*
+ * Trade the out of line body buffer for another so the body of the
+ * current message can be kept past the next stream_recv().
+ */
+void
+stream_swapxbuf(struct stream *st, void **bufp, size_t *szp)
+{
+	void *p = st->xbuf;
+	size_t sz = st->xbufsz;
+
+	st->xbuf = *bufp;
+	st->xbufsz = *szp;
+	*bufp = p;
+	*szp = sz;
+}
+
+/*
+ * Receive the next message from a stream.  Returns its body, which is
+ * valid until the next call, or NULL at EOF.  As many messages as are
+ * available are taken in with each read(2) and parsed in place.  A body
+ * too large for the receive buffer is read out of line so it is not
+ * shuffled around, and one that would be misaligned is copied out so
+ * handlers may access it as a structure.
+ */
+void *
+stream_recv(struct stream *st, struct hdr *h)
+{
+	size_t avail, len;
+	char *p;
+
+	if (st->rbuf == NULL)
+		st->rbuf = PSCALLOC(STREAM_RBUFSZ);
+
+	while (st->rlen - st->rpos < sizeof(*h))
+		if (stream_fill(st) == 0)
+			return (NULL);
+	memcpy(h, st->rbuf + st->rpos, sizeof(*h));
+	st->rpos += sizeof(*h);
+	if (h->msglen > MAX_BUFSZ)
+		psync_fatalx("invalid bufsz received from peer: %u",
+		    h->msglen);
+	psc_atomic64_inc(&stream_nrcvmsgs);
+
+	avail = st->rlen - st->rpos;
+	if (h->msglen > STREAM_RBUFSZ / 2 && avail < h->msglen) {
+		/*
+		 * With --splice, only the fixed part of file data is
+		 * taken in here; the handler moves the rest into place
+		 * with stream_recvfile().
+		 */
+		len = h->msglen;
+		if (h->opc == OPC_PUTDATA && opts.splice)
+			len = MAX(avail, sizeof(struct rpc_putdata));
+		p = stream_xbuf(st, len);
+		memcpy(p, st->rbuf + st->rpos, avail);
+		st->rpos = st->rlen = 0;
+		if (len > avail) {
+			if (atomicio_read(st->rfd, p + avail,
+			    len - avail) == 0)
+				psync_fatalx("short message from peer");
+			psc_atomic64_inc(&stream_nrcvreads);
+		}
+		st->rleft = h->msglen - len;
+		return (p);
+	}
+
+	while (st->rlen - st->rpos < h->msglen)
+		if (stream_fill(st) == 0)
+			psync_fatalx("short message from peer");
+	p = st->rbuf + st->rpos;
+	st->rpos += h->msglen;
+	if (h->msglen && (uintptr_t)p & (sizeof(uint64_t) - 1)) {
+		memcpy(stream_xbuf(st, h->msglen), p, h->msglen);
+		p = st->xbuf;
+	}
+	return (p);
+}
+
+/*
+ * Splice @len bytes from the stream into file @fd at @off.  Sockets
+ * cannot be spliced to files directly so their data goes by way of a
+ * pipe.  Returns the number of bytes moved, which is short if the
+ * kernel refuses.
+ */
+size_t
+stream_splicein(struct stream *st, int fd, off_t off, size_t len)
+{
+	size_t rem = len;
+#ifdef SPLICE_F_MOVE
+	ssize_t rc, n;
+
+	if (st->nosplicein)
+		return (0);
+	if (S_ISFIFO(st->rtype)) {
+		while (rem > 0) {
+			rc = splice(st->rfd, NULL, fd, &off, rem,
+			    SPLICE_F_MOVE);
+			psc_atomic64_inc(&stream_nrcvreads);
+			if (rc == -1 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				break;
+			rem -= rc;
+		}
+	} else {
+		if (st->rpipe[0] == st->rpipe[1] && pipe(st->rpipe) == -1) {
+			st->rpipe[0] = st->rpipe[1] = 0;
+			rem = len;
+			goto out;
+		}
+		while (rem > 0) {
+			n = splice(st->rfd, NULL, st->rpipe[1], NULL, rem,
+			    SPLICE_F_MOVE | SPLICE_F_MORE);
+			psc_atomic64_inc(&stream_nrcvreads);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			while (n > 0) {
+				rc = splice(st->rpipe[0], NULL, fd, &off, n,
+				    SPLICE_F_MOVE);
+				if (rc == -1 && errno == EINTR)
+					continue;
+				if (rc <= 0) {
+					st->nosplicein = 1;
+
+					/* already out of the stream */
+					if (atomicio_read(st->rpipe[0],
+					    st->rbuf, n) == 0)
+						psync_fatalx("splice "
+						    "pipe");
+					if (io_pwrite(fd, st->rbuf, n,
+					    off) != n)
+						psynclog_error("write "
+						    "off=%"PRId64" len=%zd",
+						    off, n);
+					off += n;
+					rem -= n;
+					goto out;
+				}
+				off += rc;
+				n -= rc;
+				rem -= rc;
+			}
+		}
+	}
+ out:
+	if (rem == len && len) {
+		psynclog_diag("splice unavailable on fd=%d: %s", st->rfd,
+		    strerror(errno));
+		st->nosplicein = 1;
+	}
+#else
+	(void)st;
+	(void)fd;
+	(void)off;
+#endif
+	return (len - rem);
+}
+
+/*
+ * Move the rest of the current message body, left in the stream by
+ * stream_recv(), into file @fd at @off.  The data is bounced through
+ * the receive buffer, now empty, wherever splicing is not possible.
+ */
+void
+stream_recvfile(struct stream *st, int fd, off_t off)
+{
+	ssize_t rc;
+	size_t n;
+
+	n = stream_splicein(st, fd, off, st->rleft);
+	if (n)
+		io_countwrite(n);
+	st->rleft -= n;
+	off += n;
+	while (st->rleft) {
+		n = MIN(st->rleft, STREAM_RBUFSZ);
+		if (atomicio_read(st->rfd, st->rbuf, n) == 0)
+			psync_fatalx("short message from peer");
+		psc_atomic64_inc(&stream_nrcvreads);
+		rc = io_pwrite(fd, st->rbuf, n, off);
+		if (rc != (ssize_t)n)
+			psynclog_error("write off=%"PRId64" len=%zd "
+			    "rc=%zd", off, n, rc);
+		st->rleft -= n;
+		off += n;
+	}
+}
+
 void
 stream_sendxv(struct stream *st, uint64_t xid, int opc,
     struct iovec *iov, int nio)
 {
-	struct hdr hdr;
+	struct sendreq sr;
 	int i;
 
-	hdr.opc = opc;
-	hdr.msglen = 0;
+	sr.sr_hdr.opc = opc;
+	sr.sr_hdr.msglen = 0;
 	for (i = 0; i < nio; i++)
-		hdr.msglen += iov[i].iov_len;
+		sr.sr_hdr.msglen += iov[i].iov_len;
 	if (xid)
-		hdr.xid = xid;
+		sr.sr_hdr.xid = xid;
 	else
-		hdr.xid = psc_atomic64_inc_getnew(&psync_xid);
+		sr.sr_hdr.xid = psc_atomic64_inc_getnew(&psync_xid);
+	sr.sr_iov = iov;
+	sr.sr_nio = nio;
+	sr.sr_fd = -1;
+	sr.sr_len = 0;
+	stream_sendreq(st, &sr);
+}
 
-	spinlock(&st->lock);
-	atomicio_write(st->wfd, &hdr, sizeof(hdr));
+/*
+ * Send a message whose trailing @len bytes are file data, moved from
+ * @fd at @off by the kernel where possible.  If that is not supported
+ * by the stream, the remainder is written from @buf, which must contain
+ * the same data.
+ */
+void
+stream_sendfilev(struct stream *st, int opc, struct iovec *iov,
+    int nio, int fd, off_t off, const void *buf, size_t len)
+{
+	struct sendreq sr;
+	int i;
+
+	sr.sr_hdr.opc = opc;
+	sr.sr_hdr.msglen = len;
 	for (i = 0; i < nio; i++)
-		atomicio_write(st->wfd, iov[i].iov_base,
-		    iov[i].iov_len);
-	freelock(&st->lock);
+		sr.sr_hdr.msglen += iov[i].iov_len;
+	sr.sr_hdr.xid = psc_atomic64_inc_getnew(&psync_xid);
+	sr.sr_iov = iov;
+	sr.sr_nio = nio;
+	sr.sr_fd = fd;
+	sr.sr_off = off;
+	sr.sr_buf = buf;
+	sr.sr_len = len;
+	stream_sendreq(st, &sr);
 }
+
 void
 stream_sendx(struct stream *st, uint64_t xid, int opc, void *p,
     size_t len)
@@ -156,11 +596,18 @@ struct stream *
 stream_create(int rfd, int wfd)
 {
 	struct stream *st;
+	struct stat stb;
 
 	st = PSCALLOC(sizeof(*st));
 	INIT_SPINLOCK(&st->lock);
+	psc_waitq_init(&st->wq, "stream");
+	st->sendq_tailp = &st->sendq;
 	st->rfd = rfd;
 	st->wfd = wfd;
+	if (fstat(wfd, &stb) == 0)
+		st->wtype = stb.st_mode & S_IFMT;
+	if (fstat(rfd, &stb) == 0)
+		st->rtype = stb.st_mode & S_IFMT;
 	push(&streams, st);
 	return (st);
 }
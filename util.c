@@ -29,11 +29,15 @@
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "pfl/alloc.h"
+#include "pfl/atomic.h"
 #include "pfl/dynarray.h"
+#include "pfl/lock.h"
 
 #include "psync.h"
 
@@ -143,3 +147,148 @@ psync_utimes(const char *fn, const struct pfl_timespec *pts, int flags)
 		psynclog_warn("utimes %s", fn);
 #endif
 }
+
+/*
+ * File descriptor variants of the above for files still open; the name
+ * is only used for diagnostics.
+ */
+void
+psync_fchown(int fd, const char *fn, uid_t uid, gid_t gid)
+{
+	if (fchown(fd, uid, gid) == -1)
+		psynclog_warn("chown %s", fn);
+}
+
+void
+psync_fchmod(int fd, const char *fn, mode_t mode)
+{
+	if (fchmod(fd, mode) == -1)
+		psynclog_warn("chmod %s", fn);
+}
+
+void
+psync_futimes(int fd, const char *fn, const struct pfl_timespec *pts)
+{
+#ifdef HAVE_FUTIMENS
+	struct timespec ts[2];
+
+	ts[0].tv_sec = pts[0].tv_sec;
+	ts[0].tv_nsec = pts[0].tv_nsec;
+
+	ts[1].tv_sec = pts[1].tv_sec;
+	ts[1].tv_nsec = pts[1].tv_nsec;
+
+	if (futimens(fd, ts) == -1)
+		psynclog_warn("utimes %s", fn);
+#else
+	struct timeval tv[2];
+
+	tv[0].tv_sec = pts[0].tv_sec;
+	tv[0].tv_usec = pts[0].tv_nsec / 1000;
+
+	tv[1].tv_sec = pts[1].tv_sec;
+	tv[1].tv_usec = pts[1].tv_nsec / 1000;
+
+	if (futimes(fd, tv) == -1)
+		psynclog_warn("utimes %s", fn);
+#endif
+}
+
+/*
+ * Reserve the blocks of a file about to be received so concurrent
+ * out-of-order writes do not fragment it, and set its final size.
+ * File systems without native support just get the size; emulating by
+ * writing zeros would cost more than it saves.
+ */
+void
+psync_fallocate(int fd, const char *fn, off_t size)
+{
+#ifdef __linux__
+	static psc_atomic32_t notsup = PSC_ATOMIC32_INIT(0);
+	int rc = 0;
+
+	if (!psc_atomic32_read(&notsup) && size) {
+		if (fallocate(fd, 0, 0, size) == -1)
+			rc = errno;
+		if (rc == EOPNOTSUPP || rc == ENOSYS || rc == EINVAL)
+			psc_atomic32_set(&notsup, 1);
+		else if (rc)
+			psynclog_warnx("fallocate %s: %s", fn,
+			    strerror(rc));
+	}
+#endif
+	if (ftruncate(fd, size) == -1)
+		psynclog_warn("truncate %s", fn);
+}
+
+struct strarena_blk {
+	psc_atomic32_t		 sab_refcnt;	/* arena + strings handed out */
+	char			 sab_data[0];
+};
+
+void
+strarena_init(struct strarena *sa)
+{
+	memset(sa, 0, sizeof(*sa));
+	INIT_SPINLOCK(&sa->sa_lock);
+}
+
+void
+strarena_blk_release(struct strarena_blk *sab)
+{
+	if (psc_atomic32_dec_getnew(&sab->sab_refcnt) == 0)
+		free(sab);
+}
+
+/*
+ * Copy a string into the arena.  Blocks are aligned to their size so a
+ * string can be released without knowing which arena it came from.
+ */
+char *
+strarena_dup(struct strarena *sa, const char *str)
+{
+	struct strarena_blk *sab;
+	size_t len;
+	char *p;
+
+	len = strlen(str) + 1;
+	if (len > STRARENA_BLKSZ - sizeof(*sab))
+		psync_fatalx("string too long: %zu", len);
+
+	spinlock(&sa->sa_lock);
+	if (sa->sa_blk == NULL || sa->sa_off + len > STRARENA_BLKSZ) {
+		if (sa->sa_blk)
+			strarena_blk_release(sa->sa_blk);
+		if (posix_memalign((void **)&sab, STRARENA_BLKSZ,
+		    STRARENA_BLKSZ))
+			psync_fatal("out of memory");
+		psc_atomic32_set(&sab->sab_refcnt, 1);
+		sa->sa_blk = sab;
+		sa->sa_off = sizeof(*sab);
+	}
+	sab = sa->sa_blk;
+	p = (char *)sab + sa->sa_off;
+	memcpy(p, str, len);
+	sa->sa_off += len;
+	psc_atomic32_inc(&sab->sab_refcnt);
+	freelock(&sa->sa_lock);
+	return (p);
+}
+
+void
+strarena_release(const char *str)
+{
+	strarena_blk_release((void *)((uintptr_t)str &
+	    ~(uintptr_t)(STRARENA_BLKSZ - 1)));
+}
+
+/*
+ * Detach the arena from its last block; queued strings keep it alive.
+ */
+void
+strarena_destroy(struct strarena *sa)
+{
+	if (sa->sa_blk)
+		strarena_blk_release(sa->sa_blk);
+	sa->sa_blk = NULL;
+}
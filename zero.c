@@ -0,0 +1,254 @@
+/* $Id$ */
+/*
+ * %PSC_START_COPYRIGHT%
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2011-2015, Pittsburgh Supercomputing Center (PSC).
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Pittsburgh Supercomputing Center	phone: 412.268.4960  fax: 412.268.5832
+ * 300 S. Craig Street			e-mail: remarks@psc.edu
+ * Pittsburgh, PA 15213			web: http://www.psc.edu/
+ * -----------------------------------------------------------------------------
+ * %PSC_END_COPYRIGHT%
+ */
+
+/*
+ * Test whether a buffer is all zeros, as done for every chunk sent
+ * with --sparse.  The scan stops at the first cache line holding a
+ * set byte and uses the widest vector unit the CPU offers, chosen
+ * once at startup unless given with --zero-check.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZERO_X86
+#include <immintrin.h>
+#endif
+
+#include "pfl/alloc.h"
+
+#include "options.h"
+#include "psync.h"
+
+#define CACHELINE		64
+#define ZERO_BENCHSZ		(64 * 1024 * 1024)
+#define ZERO_BENCHCHUNK		(64 * 1024)
+
+struct zero_impl {
+	const char		*zi_name;
+	int			(*zi_fn)(const void *, size_t);
+	int			 zi_ok;		/* CPU has what it needs */
+};
+
+int	zero_scalar(const void *, size_t);
+int	zero_sse2(const void *, size_t);
+int	zero_avx2(const void *, size_t);
+int	zero_avx512(const void *, size_t);
+
+/* slowest first */
+struct zero_impl zero_impls[] = {
+	{ "scalar",	zero_scalar,	1 },
+#ifdef ZERO_X86
+	{ "sse2",	zero_sse2,	0 },
+	{ "avx2",	zero_avx2,	0 },
+	{ "avx512",	zero_avx512,	0 },
+#endif
+};
+
+int	(*zero_check)(const void *, size_t) = zero_scalar;
+
+/*
+ * Bytes not filling a whole cache line at the end of a buffer.
+ */
+int
+zero_tail(const unsigned char *p, size_t len)
+{
+	for (; len; p++, len--)
+		if (*p)
+			return (0);
+	return (1);
+}
+
+int
+zero_scalar(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t w[CACHELINE / sizeof(uint64_t)];
+
+	for (; len >= CACHELINE; p += CACHELINE, len -= CACHELINE) {
+		memcpy(w, p, CACHELINE);
+		if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+			return (0);
+	}
+	return (zero_tail(p, len));
+}
+
+#ifdef ZERO_X86
+__attribute__((target("sse2")))
+int
+zero_sse2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m128i v;
+
+	for (; len >= CACHELINE; p += CACHELINE, len -= CACHELINE) {
+		v = _mm_or_si128(
+		    _mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+			_mm_loadu_si128((const __m128i *)(p + 16))),
+		    _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)),
+			_mm_loadu_si128((const __m128i *)(p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+		    _mm_setzero_si128())) != 0xffff)
+			return (0);
+	}
+	return (zero_tail(p, len));
+}
+
+__attribute__((target("avx2")))
+int
+zero_avx2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m256i v;
+
+	for (; len >= CACHELINE; p += CACHELINE, len -= CACHELINE) {
+		v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p),
+		    _mm256_loadu_si256((const __m256i *)(p + 32)));
+		if (!_mm256_testz_si256(v, v))
+			return (0);
+	}
+	return (zero_tail(p, len));
+}
+
+__attribute__((target("avx512f")))
+int
+zero_avx512(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__m512i v;
+
+	for (; len >= CACHELINE; p += CACHELINE, len -= CACHELINE) {
+		v = _mm512_loadu_si512((const void *)p);
+		if (_mm512_test_epi64_mask(v, v))
+			return (0);
+	}
+	return (zero_tail(p, len));
+}
+#endif
+
+void
+zero_init(void)
+{
+	size_t i;
+
+#ifdef ZERO_X86
+	__builtin_cpu_init();
+	zero_impls[1].zi_ok = __builtin_cpu_supports("sse2");
+	zero_impls[2].zi_ok = __builtin_cpu_supports("avx2");
+	zero_impls[3].zi_ok = __builtin_cpu_supports("avx512f");
+#endif
+	if (opts.zero_check != -1) {
+		zero_check = zero_impls[opts.zero_check].zi_fn;
+		return;
+	}
+	for (i = 0; i < nitems(zero_impls); i++)
+		if (zero_impls[i].zi_ok)
+			zero_check = zero_impls[i].zi_fn;
+}
+
+/*
+ * Look up an implementation for --zero-check; it has to run on this
+ * CPU.
+ */
+int
+zero_byname(const char *name)
+{
+	size_t i;
+
+	zero_init();
+	for (i = 0; i < nitems(zero_impls); i++)
+		if (strcmp(name, zero_impls[i].zi_name) == 0 &&
+		    zero_impls[i].zi_ok)
+			return (i);
+	return (-1);
+}
+
+/*
+ * Bytes per second one thread tests in chunks of ZERO_BENCHCHUNK.
+ */
+double
+zero_bench(int (*fn)(const void *, size_t), const char *buf)
+{
+	struct timespec t0, t1;
+	volatile int sink = 0;
+	size_t off;
+	int n;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < 16; n++)
+		for (off = 0; off < ZERO_BENCHSZ; off += ZERO_BENCHCHUNK)
+			sink += fn(buf + off, ZERO_BENCHCHUNK);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	(void)sink;
+	return (n * (double)ZERO_BENCHSZ / (t1.tv_sec - t0.tv_sec +
+	    (t1.tv_nsec - t0.tv_nsec) * 1e-9));
+}
+
+/*
+ * Print the implementations built in along with how fast one thread
+ * tests chunks of data (random bytes, found nonzero at once), holes
+ * (all zeros, scanned through), and a mix of holes and chunks with a
+ * single set byte somewhere, for --zero-check=list.
+ */
+void
+zero_list(FILE *fp)
+{
+	char *dense, *sparse, *mixed;
+	size_t i, off;
+
+	zero_init();
+	dense = PSCALLOC(ZERO_BENCHSZ);
+	sparse = PSCALLOC(ZERO_BENCHSZ);
+	mixed = PSCALLOC(ZERO_BENCHSZ);
+	for (off = 0; off < ZERO_BENCHSZ; off++)
+		dense[off] = random() | 1;
+	for (off = 0; off < ZERO_BENCHSZ; off += 2 * ZERO_BENCHCHUNK)
+		mixed[off + random() % ZERO_BENCHCHUNK] = 1;
+
+	fprintf(fp, "%-8s  %14s  %14s  %14s\n", "", "dense", "sparse",
+	    "mixed");
+	for (i = 0; i < nitems(zero_impls); i++) {
+		if (!zero_impls[i].zi_ok) {
+			fprintf(fp, "%-8s  not supported by this CPU\n",
+			    zero_impls[i].zi_name);
+			continue;
+		}
+		fprintf(fp, "%-8s  %9.1f GB/s  %9.1f GB/s  %9.1f GB/s%s\n",
+		    zero_impls[i].zi_name,
+		    zero_bench(zero_impls[i].zi_fn, dense) * 1e-9,
+		    zero_bench(zero_impls[i].zi_fn, sparse) * 1e-9,
+		    zero_bench(zero_impls[i].zi_fn, mixed) * 1e-9,
+		    zero_impls[i].zi_fn == zero_check ? "  (in use)" : "");
+	}
+	PSCFREE(dense);
+	PSCFREE(sparse);
+	PSCFREE(mixed);
+}